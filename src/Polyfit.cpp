@@ -41,6 +41,32 @@
 #include <sstream>
 #include <cstdlib>
 #include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+
+#include <csignal>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#endif
 
 using namespace std;
 
@@ -76,6 +102,214 @@ using namespace std;
 #define STOP 1.0e-8
 #define TINY 1.0e-30
 
+// Profiling of the phases of the program
+// A ProfileScope records the wall time, the number and size of the
+// allocations made with new, the peak resident memory and, if available,
+// the cpu cycles and cache misses between its construction and its
+// destruction. When profiling is off, a scope only tests a flag.
+// **************************************************************
+struct ProfileEvent {
+    std::string name;
+    int thread;                                      // Index of the thread of the scope
+    int depth;                                       // Nesting level of the scope in its thread
+    double start;                                    // Start time (us)
+    double duration;                                 // Duration (us)
+    size_t allocs;                                   // Number of allocations
+    size_t bytes;                                    // Bytes allocated
+    long peakrss;                                    // Peak resident memory at the end (kB)
+    long long cycles;                                // Cpu cycles (-1 if not available)
+    long long cachemisses;                           // Cache misses (-1 if not available)
+};
+
+std::atomic<bool> profileon(false);                  // Profiling enabled
+std::atomic<size_t> profileallocs(0);                // Allocations made while profiling
+std::atomic<size_t> profilebytes(0);                 // Bytes allocated while profiling
+std::atomic<int> profilethreads(0);                  // Number of threads which opened a scope
+thread_local int profilethread = -1;                 // Index of the calling thread (-1 = none yet)
+thread_local int profiledepth = 0;                   // Nesting level of the scopes of the calling thread
+int perffd[2] = { -1, -1 };                          // perf_event_open counters (cycles, cache misses)
+std::chrono::steady_clock::time_point profilet0;
+std::mutex profilelock;                              // Protects the events
+std::vector<ProfileEvent>* profileevents = NULL;
+
+// Replacement of the global allocation functions, counting the allocations
+// The benchmark (src/PolyfitBench.cpp) defines POLYFIT_NO_ALLOC_HOOKS so
+// that its timings use the default allocator.
+#ifndef POLYFIT_NO_ALLOC_HOOKS
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(size_t size) {
+    if (profileon.load(std::memory_order_relaxed)) {
+        profileallocs.fetch_add(1, std::memory_order_relaxed);
+        profilebytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    void* p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+#pragma GCC diagnostic pop
+#endif // POLYFIT_NO_ALLOC_HOOKS
+
+// Read a perf_event_open counter, -1 if not available
+// **************************************************************
+long long ReadPerfCounter(const int fd) {
+
+    long long value = -1;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) return -1;
+    return value;
+
+}
+
+// Open the cycle and cache miss counters of the calling process
+// **************************************************************
+void OpenPerfCounters() {
+
+#ifdef __linux__
+    const unsigned long long configs[2] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES };
+    for (int c = 0; c < 2; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[c];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        perffd[c] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+    if (perffd[0] < 0) {
+        cout << "Hardware counters are not available (perf_event_open)" << endl;
+    }
+
+}
+
+class ProfileScope {
+public:
+    explicit ProfileScope(const char* name) : active(profileon) {
+        if (!active) return;
+        if (profilethread < 0) profilethread = profilethreads++;
+        event.name = name;
+        event.thread = profilethread;
+        event.depth = profiledepth++;
+        event.allocs = profileallocs;
+        event.bytes = profilebytes;
+        event.cycles = ReadPerfCounter(perffd[0]);
+        event.cachemisses = ReadPerfCounter(perffd[1]);
+        event.start = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - profilet0).count();
+    }
+
+    ~ProfileScope() {
+        Stop();
+    }
+
+    // End the scope before its destruction
+    void Stop() {
+        if (!active) return;
+        active = false;
+        double end = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - profilet0).count();
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        event.duration = end - event.start;
+        event.allocs = profileallocs - event.allocs;
+        event.bytes = profilebytes - event.bytes;
+        event.peakrss = usage.ru_maxrss;
+        if (event.cycles >= 0) event.cycles = ReadPerfCounter(perffd[0]) - event.cycles;
+        if (event.cachemisses >= 0) event.cachemisses = ReadPerfCounter(perffd[1]) - event.cachemisses;
+        profiledepth--;
+        std::lock_guard<std::mutex> guard(profilelock);
+        profileevents->push_back(event);
+    }
+
+private:
+    bool active;
+    ProfileEvent event;
+};
+
+// Enable the profiling for the lifetime of the session and write the
+// events in a trace-event JSON file (chrome://tracing, Perfetto) at the end
+// **************************************************************
+class ProfileSession {
+public:
+    ProfileSession(const std::string& file, const bool counters) : filename(file) {
+        if (filename.empty()) return;
+        profileevents = new std::vector<ProfileEvent>();
+        if (counters) OpenPerfCounters();
+        profilet0 = std::chrono::steady_clock::now();
+        profileon = true;
+    }
+
+    ~ProfileSession() {
+        if (filename.empty()) return;
+        profileon = false;
+        WriteProfile();
+        for (int c = 0; c < 2; c++) {
+            if (perffd[c] >= 0) close(perffd[c]);
+        }
+        delete profileevents;
+        profileevents = NULL;
+    }
+
+private:
+    std::string filename;
+
+    void WriteProfile() {
+
+        std::vector<ProfileEvent>& events = *profileevents;
+        std::sort(events.begin(), events.end(), [](const ProfileEvent& a, const ProfileEvent& b) {
+            return a.start < b.start;
+        });
+
+        cout << endl << "Profile" << endl;
+        cout << "Phase\tTime (ms)\tAllocs\tBytes\tPeak RSS (kB)\tCycles\tCache misses" << endl;
+        for (size_t i = 0; i < events.size(); i++) {
+            const ProfileEvent& e = events[i];
+            cout << std::string(2 * e.depth, ' ') << e.name << "\t" << e.duration / 1000. << "\t" << e.allocs;
+            cout << "\t" << e.bytes << "\t" << e.peakrss << "\t" << e.cycles << "\t" << e.cachemisses << endl;
+        }
+
+        ofstream output;
+        output.open(filename.c_str());
+        output << std::setprecision(15);
+        output << "{\"traceEvents\": [";
+        for (size_t i = 0; i < events.size(); i++) {
+            const ProfileEvent& e = events[i];
+            output << (i == 0 ? "" : ",") << endl;
+            output << "{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.thread + 1;
+            output << ", \"ts\": " << e.start << ", \"dur\": " << e.duration;
+            output << ", \"args\": {\"allocs\": " << e.allocs << ", \"bytes\": " << e.bytes;
+            output << ", \"peak_rss_kb\": " << e.peakrss;
+            if (e.cycles >= 0) output << ", \"cycles\": " << e.cycles;
+            if (e.cachemisses >= 0) output << ", \"cache_misses\": " << e.cachemisses;
+            output << "}}";
+        }
+        output << endl << "], \"displayTimeUnit\": \"ms\"}" << endl;
+        output.close();
+
+        cout << "Profile written to " << filename << endl;
+
+    }
+};
+
 // Function to compute the derivative of the polynomial at a given x
 // **************************************************************
 double polynomial_derivative(double x, const double coef[], size_t k) {
@@ -86,6 +320,24 @@ double polynomial_derivative(double x, const double coef[], size_t k) {
     return derivative;
 }
 
+// Generate the polynomial curve drawn by plot_data_and_polynomial, with a
+// step of 0.1 over the range of x_values
+// **************************************************************
+void generate_polynomial_curve(const std::vector<double>& x_values, const double coef[], size_t k,
+    std::vector<double>& x_curve, std::vector<double>& y_curve) {
+    x_curve.clear();
+    y_curve.clear();
+    double xmax = *std::max_element(x_values.begin(), x_values.end());
+    for (double x = *std::min_element(x_values.begin(), x_values.end()); x <= xmax; x += 0.1) {
+        double y = 0;
+        for (size_t i = 0; i <= k; ++i) {
+            y += coef[i] * std::pow(x, i);
+        }
+        x_curve.push_back(x);
+        y_curve.push_back(y);
+    }
+}
+
 // Functions to plot using GNUplot
 // **************************************************************
 void plot_data_and_polynomial(const std::vector<double>& x_values, const std::vector<double>& y_values, const double coef[], size_t k) {
@@ -95,10 +347,12 @@ void plot_data_and_polynomial(const std::vector<double>& x_values, const std::ve
         return;
     }
 
-    // Open a pipe to GNUplot
+    // Open a pipe to GNUplot (a missing gnuplot must not kill the program)
+    void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
     FILE* gnuplot = popen("gnuplot -persistent", "w");
     if (!gnuplot) {
         std::cerr << "Error: Could not open GNUplot!" << std::endl;
+        signal(SIGPIPE, sigpipe);
         return;
     }
 
@@ -120,17 +374,16 @@ void plot_data_and_polynomial(const std::vector<double>& x_values, const std::ve
     fprintf(gnuplot, "e\n");  // End of data for points
 
     // Polynomial curve (generated from the coefficients)
-    for (double x = *std::min_element(x_values.begin(), x_values.end()); x <= *std::max_element(x_values.begin(), x_values.end()); x += 0.1) {
-        double y = 0;
-        for (size_t i = 0; i <= k; ++i) {
-            y += coef[i] * std::pow(x, i);
-        }
-        fprintf(gnuplot, "%f %f\n", x, y);
+    std::vector<double> x_curve, y_curve;
+    generate_polynomial_curve(x_values, coef, k, x_curve, y_curve);
+    for (size_t i = 0; i < x_curve.size(); ++i) {
+        fprintf(gnuplot, "%f %f\n", x_curve[i], y_curve[i]);
     }
     fprintf(gnuplot, "e\n");  // End of data for polynomial curve
 
     // Close the gnuplot pipe
-    fclose(gnuplot);
+    pclose(gnuplot);
+    signal(SIGPIPE, sigpipe);
 }
 
 
@@ -303,6 +556,30 @@ void Free2DArray(double** array, const size_t rows) {
 }
 
 
+// Run body(i) for every i in [0,count) on all the available cores
+// **************************************************************
+void ParallelFor(const size_t count, const std::function<void(size_t)>& body) {
+
+    size_t nthreads = std::thread::hardware_concurrency();
+    if (nthreads > count) nthreads = count;
+
+    if (nthreads <= 1) {
+        for (size_t i = 0; i < count; i++) body(i);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < nthreads; t++) {
+        workers.emplace_back([&]() {
+            size_t i;
+            while ((i = next++) < count) body(i);
+        });
+    }
+    for (size_t t = 0; t < nthreads; t++) workers[t].join();
+
+}
+
 // Transpose a 2D array
 // **************************************************************
 double** MatTrans(double** array, const size_t rows, const size_t cols) {
@@ -450,6 +727,211 @@ void cofactor(double** num, double** inverse, const size_t f)
     Free2DArray(fac,f);
 }
 
+// Cholesky factorization A = L*LT of a symmetric positive definite matrix
+// The matrix is first scaled by D = diag(A)^-1/2 so that the large spread
+// of the power sums does not spoil the factorization. The scaling is kept
+// in D and used by the solve routines. Returns false if A is not positive
+// definite.
+// **************************************************************
+bool CholeskyDecomp(double** A, double** L, double* D, const size_t f) {
+
+    for (size_t i = 0; i < f; i++) {
+        D[i] = (A[i][i] > 0.) ? 1. / sqrt(A[i][i]) : 1.;
+    }
+
+    for (size_t i = 0; i < f; i++) {
+        for (size_t j = 0; j <= i; j++) {
+            double sum = A[i][j] * D[i] * D[j];
+            for (size_t m = 0; m < j; m++) {
+                sum -= L[i][m] * L[j][m];
+            }
+            if (i == j) {
+                if (sum <= 0.) return false;
+                L[i][i] = sqrt(sum);
+            }
+            else {
+                L[i][j] = sum / L[j][j];
+            }
+        }
+        for (size_t j = i + 1; j < f; j++) {
+            L[i][j] = 0.;
+        }
+    }
+
+    return true;
+
+}
+
+// Solve A*sol = b using the factorization computed by CholeskyDecomp
+// **************************************************************
+void CholeskySolve(double** L, const double* D, const double* b, double* sol, const size_t f) {
+
+    // Forward substitution L*z = D*b
+    for (size_t i = 0; i < f; i++) {
+        double sum = D[i] * b[i];
+        for (size_t m = 0; m < i; m++) {
+            sum -= L[i][m] * sol[m];
+        }
+        sol[i] = sum / L[i][i];
+    }
+
+    // Backward substitution LT*u = z, then sol = D*u
+    for (size_t i = f; i-- > 0;) {
+        double sum = sol[i];
+        for (size_t m = i + 1; m < f; m++) {
+            sum -= L[m][i] * sol[m];
+        }
+        sol[i] = sum / L[i][i];
+    }
+
+    for (size_t i = 0; i < f; i++) {
+        sol[i] *= D[i];
+    }
+
+}
+
+// Calculate the inverse of A from the factorization computed by CholeskyDecomp
+// **************************************************************
+void CholeskyInverse(double** L, const double* D, double** inverse, const size_t f) {
+
+    double* e = new double[f];
+    double* col = new double[f];
+
+    for (size_t j = 0; j < f; j++) {
+        for (size_t i = 0; i < f; i++) {
+            e[i] = (i == j) ? 1. : 0.;
+        }
+        CholeskySolve(L, D, e, col, f);
+        for (size_t i = 0; i < f; i++) {
+            inverse[i][j] = col[i];
+        }
+    }
+
+    delete[] e;
+    delete[] col;
+
+}
+
+
+// Eigen-decomposition A = V*diag(eval)*VT of a symmetric matrix with the
+// cyclic Jacobi method. A is overwritten.
+// **************************************************************
+void JacobiEigen(double** A, double* eval, double** V, const size_t f) {
+
+    for (size_t i = 0; i < f; i++) {
+        for (size_t j = 0; j < f; j++) V[i][j] = (i == j) ? 1. : 0.;
+    }
+
+    for (int sweep = 0; sweep < MAXIT; sweep++) {
+
+        double off = 0.;
+        double diag = 0.;
+        for (size_t i = 0; i < f; i++) {
+            diag += A[i][i] * A[i][i];
+            for (size_t j = i + 1; j < f; j++) off += A[i][j] * A[i][j];
+        }
+        if (off <= 1.e-30 * diag) break;
+
+        for (size_t p = 0; p < f; p++) {
+            for (size_t q = p + 1; q < f; q++) {
+                if (A[p][q] == 0.) continue;
+                double theta = (A[q][q] - A[p][p]) / (2. * A[p][q]);
+                double t = (theta >= 0. ? 1. : -1.) / (fabs(theta) + sqrt(theta * theta + 1.));
+                double c = 1. / sqrt(t * t + 1.);
+                double s = t * c;
+                for (size_t r = 0; r < f; r++) {
+                    double arp = A[r][p];
+                    double arq = A[r][q];
+                    A[r][p] = c * arp - s * arq;
+                    A[r][q] = s * arp + c * arq;
+                }
+                for (size_t r = 0; r < f; r++) {
+                    double apr = A[p][r];
+                    double aqr = A[q][r];
+                    A[p][r] = c * apr - s * aqr;
+                    A[q][r] = s * apr + c * aqr;
+                }
+                for (size_t r = 0; r < f; r++) {
+                    double vrp = V[r][p];
+                    double vrq = V[r][q];
+                    V[r][p] = c * vrp - s * vrq;
+                    V[r][q] = s * vrp + c * vrq;
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < f; i++) eval[i] = A[i][i];
+
+}
+
+// LU factorization with partial pivoting of a band matrix of order N with
+// kl sub-diagonals and ku super-diagonals. Row i of ab stores column j at
+// ab[i][j - i + kl] and must have 2*kl+ku+1 entries to hold the fill-in
+// created by the row interchanges. The multipliers are stored in lower[N][kl]
+// and the interchanges in piv. Returns false if the matrix is singular.
+// **************************************************************
+bool BandLUDecomp(double** ab, double** lower, size_t* piv, const size_t N, const size_t kl, const size_t ku) {
+
+    for (size_t p = 0; p < N; p++) {
+
+        size_t last = min(N - 1, p + kl);
+        size_t lastcol = min(N - 1, p + kl + ku);
+
+        // Find the pivot in column p
+        size_t r = p;
+        for (size_t i = p + 1; i <= last; i++) {
+            if (fabs(ab[i][p - i + kl]) > fabs(ab[r][p - r + kl])) r = i;
+        }
+        piv[p] = r;
+        if (ab[r][p - r + kl] == 0.) return false;
+
+        if (r != p) {
+            for (size_t j = p; j <= lastcol; j++) {
+                swap(ab[p][j - p + kl], ab[r][j - r + kl]);
+            }
+        }
+
+        // Eliminate the entries below the pivot
+        for (size_t i = p + 1; i <= last; i++) {
+            double factor = ab[i][p - i + kl] / ab[p][kl];
+            lower[p][i - p - 1] = factor;
+            ab[i][p - i + kl] = 0.;
+            if (factor == 0.) continue;
+            for (size_t j = p + 1; j <= lastcol; j++) {
+                ab[i][j - i + kl] -= factor * ab[p][j - p + kl];
+            }
+        }
+    }
+
+    return true;
+
+}
+
+// Solve A*sol = b using the factorization computed by BandLUDecomp
+// b is overwritten.
+// **************************************************************
+void BandLUSolve(double** ab, double** lower, const size_t* piv, const size_t N, const size_t kl, const size_t ku,
+    double* b, double* sol) {
+
+    for (size_t p = 0; p < N; p++) {
+        if (piv[p] != p) swap(b[p], b[piv[p]]);
+        size_t last = min(N - 1, p + kl);
+        for (size_t i = p + 1; i <= last; i++) {
+            b[i] -= lower[p][i - p - 1] * b[p];
+        }
+    }
+
+    for (size_t i = N; i-- > 0;) {
+        double sum = b[i];
+        size_t lastcol = min(N - 1, i + kl + ku);
+        for (size_t j = i + 1; j <= lastcol; j++) {
+            sum -= ab[i][j - i + kl] * sol[j];
+        }
+        sol[i] = sum / ab[i][kl];
+    }
+
+}
 
 // Display a matrix 
 // **************************************************************
@@ -517,6 +999,52 @@ double CalculateTSS(const double* y, double** Weights,
 
 }
 
+// Calculate the residual sum of squares (RSS) with the diagonal weights w
+// **************************************************************
+double CalculateRSS(const double* x, const double* y, const double* a, const double* w,
+    const size_t N, const size_t n) {
+
+    double r2 = 0.;
+    for (size_t i = 0; i < N; i++) {
+        double poly = a[n - 1];
+        for (size_t j = n - 1; j-- > 0;) {
+            poly = poly * x[i] + a[j];
+        }
+        r2 += (y[i] - poly) * (y[i] - poly) * w[i];
+    }
+
+    return r2;
+
+}
+
+// Calculate the total sum of squares (TSS) with the diagonal weights w
+// **************************************************************
+double CalculateTSS(const double* y, const double* w, const bool fixed, const size_t N) {
+
+    double r2 = 0.;
+    double sumwy = 0.;
+    double sumweights = 0.;
+
+    if (fixed) {
+        for (size_t i = 0; i < N; i++) {
+            r2 += y[i] * y[i] * w[i];
+        }
+    }
+    else {
+        for (size_t i = 0; i < N; i++) {
+            sumwy += y[i] * w[i];
+            sumweights += w[i];
+        }
+        for (size_t i = 0; i < N; i++) {
+            double ri = y[i] - sumwy / sumweights;
+            r2 += ri * ri * w[i];
+        }
+    }
+
+    return r2;
+
+}
+
 // Calculate coefficient R2 - COD
 // **************************************************************
 double CalculateR2COD(const double* x, const double* y, const double* a, double** Weights,
@@ -572,6 +1100,7 @@ void PolyFit(const double* x, double* y, const size_t n, const size_t k, const b
 
     // Initialize X
     // **************************************************************
+    ProfileScope build("build_matrices");
     for (size_t i = 0; i < n; i++) {
         for (size_t j = begin; j < (k + 1); j++) {  // begin
             X[i][j] = pow(x[i], j);
@@ -583,10 +1112,13 @@ void PolyFit(const double* x, double* y, const size_t n, const size_t k, const b
     XT = MatTrans(X, n, k + 1);                 // Calculate XT
     XTW = MatMul(k + 1, n, n, XT, Weights);         // Calculate XT*W
     XTWX = MatMul(k + 1, n, k + 1, XTW, X);           // Calculate (XTW)*X
+    build.Stop();
 
     if (fixedinter) XTWX[0][0] = 1.;
 
+    ProfileScope inversion("inversion");
     cofactor(XTWX, XTWXInv, k + 1);             // Calculate (XTWX)^-1
+    inversion.Stop();
 
     for (size_t m = 0; m < n; m++) {
         if (fixedinter) {
@@ -601,6 +1133,7 @@ void PolyFit(const double* x, double* y, const size_t n, const size_t k, const b
 
     if (fixedinter) beta[0] = fixedinterval;
 
+    ProfileScope display("display_matrices");
     cout << "Matrix X" << endl;
     displayMat(X, n, k + 1);
 
@@ -622,6 +1155,124 @@ void PolyFit(const double* x, double* y, const size_t n, const size_t k, const b
 
 }
 
+// Accumulate the weighted power sums S[0..2k] and XTWY[m][k+1] of the
+// points in a single pass. S and XTWY are added to, so several batches of
+// points can be accumulated in the same sums.
+// **************************************************************
+void AccumulatePowerSums(const double* x, double** Y, const double* w, const size_t n, const size_t m,
+    const size_t k, double* S, double** XTWY) {
+
+    double* xp = new double[k + 1];                 // Powers of x[i]
+
+    for (size_t i = 0; i < n; i++) {
+        double p = w[i];
+        for (size_t j = 0; j < 2 * k + 1; j++) {
+            if (j < k + 1) xp[j] = p;
+            S[j] += p;
+            p *= x[i];
+        }
+        for (size_t r = 0; r < m; r++) {
+            double yr = Y[r][i];
+            for (size_t j = 0; j < (k + 1); j++) {
+                XTWY[r][j] += xp[j] * yr;
+            }
+        }
+    }
+
+    delete[] xp;
+
+}
+
+// Solve the fit of m responses from the weighted power sums S[0..2k] and
+// XTWY[m][k+1] of AccumulatePowerSums (not shifted by the fixed intercept)
+// XTWX is factored once and every response is obtained by a back-solve.
+// Returns false if XTWX is not positive definite and the cofactor inverse
+// was used instead.
+// **************************************************************
+bool SolvePowerSums(const double* S, double** XTWY, const size_t m, const size_t k, const bool fixedinter,
+    const double fixedinterval, double** beta, double** XTWXInv) {
+
+    double** XTWX = Make2DArray(k + 1, k + 1);      // [k+1,k+1]
+    double** L = Make2DArray(k + 1, k + 1);         // Cholesky factor of XTWX
+    double* D = new double[k + 1];                  // Scaling of XTWX
+    double* b = new double[k + 1];                  // XTWY of the shifted response
+
+    size_t begin = 0;
+    if (fixedinter) begin = 1;
+
+    for (size_t j = begin; j < (k + 1); j++) {
+        for (size_t l = begin; l < (k + 1); l++) {
+            XTWX[j][l] = S[j + l];
+        }
+    }
+
+    if (fixedinter) XTWX[0][0] = 1.;
+
+    bool cholesky = CholeskyDecomp(XTWX, L, D, k + 1);
+    if (!cholesky) {
+        cofactor(XTWX, XTWXInv, k + 1);
+    }
+    else {
+        CholeskyInverse(L, D, XTWXInv, k + 1);
+    }
+
+    for (size_t r = 0; r < m; r++) {
+        b[0] = 0.;
+        for (size_t j = begin; j < (k + 1); j++) {
+            b[j] = fixedinter ? XTWY[r][j] - fixedinterval * S[j] : XTWY[r][j];
+        }
+        if (!cholesky) {
+            MatVectMul(k + 1, k + 1, XTWXInv, b, beta[r]);
+        }
+        else {
+            CholeskySolve(L, D, b, beta[r], k + 1);
+        }
+        if (fixedinter) beta[r][0] = fixedinterval;
+    }
+
+    Free2DArray(XTWX, k + 1);
+    Free2DArray(L, k + 1);
+    delete[] D;
+    delete[] b;
+
+    return cholesky;
+
+}
+
+// Perform the fit of m responses Y[0..m-1][n] sampled at the same x values
+// XTWX is built from the weighted power sums and XTWY for all responses
+// in the same pass over the data. XTWX is factored once and every response
+// is obtained by a back-solve, so beta[r] holds the k+1 coefficients of
+// response r. XTWXInv is shared by all responses. w holds the diagonal of
+// the weights matrix.
+// **************************************************************
+void PolyFit(const double* x, double** Y, const size_t n, const size_t m, const size_t k, const bool fixedinter,
+    const double fixedinterval, double** beta, const double* w, double** XTWXInv) {
+
+    double** XTWY = Make2DArray(m, k + 1);          // [m,k+1]
+    double* S = new double[2 * k + 1];              // Weighted power sums
+
+    for (size_t j = 0; j < 2 * k + 1; j++) S[j] = 0.;
+
+    // Accumulate the power sums and XTWY in a single pass
+    // **************************************************************
+    ProfileScope accumulate("accumulate");
+    AccumulatePowerSums(x, Y, w, n, m, k, S, XTWY);
+    accumulate.Stop();
+
+    // Factor XTWX once, then solve for every response
+    // **************************************************************
+    ProfileScope factor("factor");
+    if (!SolvePowerSums(S, XTWY, m, k, fixedinter, fixedinterval, beta, XTWXInv)) {
+        cout << "Matrix XTWX is not positive definite, using the cofactor inverse" << endl;
+    }
+    factor.Stop();
+
+    Free2DArray(XTWY, m);
+    delete[] S;
+
+}
+
 // Calculate the polynomial at a given x value
 // **************************************************************
 double calculatePoly(const double x, const double* a, const size_t n) {
@@ -636,6 +1287,27 @@ double calculatePoly(const double x, const double* a, const size_t n) {
 
 }
 
+// Calculate the polynomial and its first two derivatives at a given x value
+// using Horner's scheme
+// **************************************************************
+void calculatePolyDerivs(const double x, const double* a, const size_t n, double* p, double* dp, double* d2p) {
+
+    double p0 = a[n];
+    double p1 = 0.;
+    double p2 = 0.;
+
+    for (size_t i = n; i-- > 0;) {
+        p2 = p2 * x + 2. * p1;
+        p1 = p1 * x + p0;
+        p0 = p0 * x + a[i];
+    }
+
+    *p = p0;
+    *dp = p1;
+    *d2p = p2;
+
+}
+
 // Calculate and write the confidence bands in a file
 // **************************************************************
 void WriteCIBands(std::string filename, const double* x, const double* coefbeta, double** XTXInv,
@@ -710,6 +1382,26 @@ void CalculateWeights(const double* erry, double** Weights, const size_t n,
 
 }
 
+// Calculate the diagonal of the weights matrix
+// **************************************************************
+void CalculateWeights(const double* erry, double* w, const size_t n, const int type) {
+
+    for (size_t i = 0; i < n; i++) {
+        switch (type) {
+            case 0:
+                w[i] = 1.;
+                break;
+            case 1:
+                w[i] = erry[i];
+                break;
+            case 2:
+                w[i] = (erry[i] > 0.) ? 1. / (erry[i] * erry[i]) : 0.;
+                break;
+        }
+    }
+
+}
+
 // Calculate the standard error on the beta coefficients
 // **************************************************************
 void CalculateSERRBeta(const bool fixedinter, const double SE, size_t k, double* serbeta, double** XTWXInv) {
@@ -844,35 +1536,4371 @@ void DisplayCovCorrMatrix(const size_t k, const double sigma, const bool fixed,
 }
 
 
-// The main program
+// Perform a ridge (Tikhonov) fit for every lambda of the grid lambdas[nl]
+// The intercept is not penalized: the columns x^1..x^k are centered on their
+// weighted means (unless the intercept is fixed) and scaled to unit
+// diagonal, giving the matrix A. A = V*diag(ev)*VT is computed once, after
+// which every lambda costs O(k^2):
+//   gamma = V*diag(1/(ev+lambda))*VT*b,   edf = sum ev/(ev+lambda)
+//   GCV = n*RSS/(n-edf)^2
+// edf, rss and gcv receive the values on the grid. The lambda with the
+// lowest GCV is selected: its coefficients are returned in beta and the
+// matrix such that Cov(beta) = sigma^2 * XTWXInv in XTWXInv, so that the
+// usual covariance and CI-band routines can be used. Returns the index of
+// the selected lambda.
 // **************************************************************
-int main(int argc, char* argv[]) {
+size_t PolyFitRidge(const double* x, const double* y, const size_t n, const size_t k, const bool fixedinter,
+    const double fixedinterval, const double* w, const double* lambdas, const size_t nl,
+    double* edf, double* rss, double* gcv, double* beta, double** XTWXInv) {
+
+    double* S = new double[2 * k + 1];               // Weighted power sums
+    double* SY = new double[k + 1];                  // Weighted sums of x^j*y
+    double** A = Make2DArray(k, k);                  // Scaled centered Gram matrix
+    double** V = Make2DArray(k, k);                  // Eigenvectors of A
+    double* ev = new double[k];                      // Eigenvalues of A
+    double* b = new double[k];                       // Scaled centered XTWY
+    double* c = new double[k];                       // VT*b
+    double* D = new double[k];                       // Column scaling
+    double* mean = new double[k + 1];                // Weighted means of x^j
+    double* g = new double[k];
+    double syy = 0.;
+
+    for (size_t j = 0; j < 2 * k + 1; j++) S[j] = 0.;
+    for (size_t j = 0; j < k + 1; j++) SY[j] = 0.;
 
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <input file>\n";
-        return 1;
-    }
+    for (size_t i = 0; i < n; i++) {
+        double yi = fixedinter ? y[i] - fixedinterval : y[i];
+        double p = w[i];
+        for (size_t j = 0; j < 2 * k + 1; j++) {
+            S[j] += p;
+            if (j < k + 1) SY[j] += p * yi;
+            p *= x[i];
+        }
+        syy += w[i] * yi * yi;
+    }
+
+    // Center (free intercept) and scale the columns 1..k
+    // **************************************************************
+    double ymean = 0.;
+    for (size_t j = 0; j < k + 1; j++) mean[j] = 0.;
+    if (!fixedinter) {
+        for (size_t j = 0; j < k + 1; j++) mean[j] = S[j] / S[0];
+        ymean = SY[0] / S[0];
+    }
+
+    double TSS = syy - ymean * SY[0];
+    for (size_t i = 0; i < k; i++) {
+        for (size_t j = 0; j < k; j++) {
+            A[i][j] = S[i + j + 2] - mean[i + 1] * S[j + 1];
+        }
+        b[i] = SY[i + 1] - mean[i + 1] * SY[0];
+    }
+    for (size_t i = 0; i < k; i++) {
+        D[i] = (A[i][i] > 0.) ? 1. / sqrt(A[i][i]) : 1.;
+    }
+    for (size_t i = 0; i < k; i++) {
+        for (size_t j = 0; j < k; j++) A[i][j] *= D[i] * D[j];
+        b[i] *= D[i];
+    }
+
+    JacobiEigen(A, ev, V, k);
+
+    for (size_t i = 0; i < k; i++) {
+        c[i] = 0.;
+        for (size_t j = 0; j < k; j++) c[i] += V[j][i] * b[j];
+    }
+
+    // Evaluate the whole lambda grid
+    // **************************************************************
+    double nfree = fixedinter ? 0. : 1.;
+    size_t best = 0;
+    for (size_t l = 0; l < nl; l++) {
+        edf[l] = nfree;
+        rss[l] = TSS;
+        for (size_t i = 0; i < k; i++) {
+            double den = ev[i] + lambdas[l];
+            if (den <= 0.) continue;
+            edf[l] += ev[i] / den;
+            rss[l] -= c[i] * c[i] * (ev[i] + 2. * lambdas[l]) / (den * den);
+        }
+        if (rss[l] < 0.) rss[l] = 0.;
+        gcv[l] = n * rss[l] / ((n - edf[l]) * (n - edf[l]));
+        if (gcv[l] < gcv[best]) best = l;
+    }
+
+    // Coefficients and covariance of the selected lambda
+    // **************************************************************
+    double lambda = lambdas[best];
+    for (size_t i = 0; i < k; i++) {
+        double den = ev[i] + lambda;
+        g[i] = (den > 0.) ? c[i] / den : 0.;
+    }
+    beta[0] = fixedinter ? fixedinterval : ymean;
+    for (size_t j = 0; j < k; j++) {
+        double gamma = 0.;
+        for (size_t i = 0; i < k; i++) gamma += V[j][i] * g[i];
+        beta[j + 1] = D[j] * gamma;
+        beta[0] -= mean[j + 1] * beta[j + 1];
+    }
+
+    // Cov(beta_1..k)/sigma^2 = D*V*diag(ev/(ev+lambda)^2)*VT*D
+    for (size_t i = 0; i < k; i++) {
+        for (size_t j = 0; j < k; j++) {
+            double sum = 0.;
+            for (size_t l = 0; l < k; l++) {
+                double den = ev[l] + lambda;
+                if (den > 0.) sum += V[i][l] * V[j][l] * ev[l] / (den * den);
+            }
+            XTWXInv[i + 1][j + 1] = D[i] * D[j] * sum;
+        }
+    }
+
+    // beta_0 = ymean - sum mean_j*beta_j, with ymean independent of beta_1..k
+    XTWXInv[0][0] = fixedinter ? 0. : 1. / S[0];
+    for (size_t j = 0; j < k; j++) {
+        double sum = 0.;
+        for (size_t i = 0; i < k; i++) sum += mean[i + 1] * XTWXInv[i + 1][j + 1];
+        XTWXInv[0][j + 1] = -sum;
+        XTWXInv[j + 1][0] = -sum;
+        XTWXInv[0][0] += mean[j + 1] * sum;
+    }
+
+    delete[] S;
+    delete[] SY;
+    Free2DArray(A, k);
+    Free2DArray(V, k);
+    delete[] ev;
+    delete[] b;
+    delete[] c;
+    delete[] D;
+    delete[] mean;
+    delete[] g;
+
+    return best;
+
+}
+
+// Perform the ridge fit and display the results
+// If lambda is negative, it is selected by GCV on a log-spaced grid.
+// **************************************************************
+void FitRidge(const double* x, double* y, const size_t n, const size_t k, const bool fixedinter,
+    const double fixedinterval, const double alphaval, const double lambda, const double* w) {
+
+    const size_t nl = (lambda >= 0.) ? 1 : 121;
+    double* lambdas = new double[nl];
+    double* edf = new double[nl];
+    double* rss = new double[nl];
+    double* gcv = new double[nl];
+    double* coefbeta = new double[k + 1];
+    double* serbeta = new double[k + 1];
+    double** XTWXInv = Make2DArray(k + 1, k + 1);
+
+    // The scaled Gram matrix has a unit diagonal, so lambda is relative
+    if (nl == 1) {
+        lambdas[0] = lambda;
+    }
+    else {
+        lambdas[0] = 0.;
+        for (size_t l = 1; l < nl; l++) {
+            lambdas[l] = pow(10., -12. + 14. * (l - 1) / (nl - 2.));
+        }
+    }
+
+    size_t best = PolyFitRidge(x, y, n, k, fixedinter, fixedinterval, w, lambdas, nl, edf, rss, gcv,
+        coefbeta, XTWXInv);
+
+    if (nl > 1) {
+        cout << "Ridge path" << endl;
+        cout << "Lambda\tEDF\tRSS\tGCV" << endl;
+        for (size_t l = 0; l < nl; l += 10) {
+            cout << lambdas[l] << "\t" << edf[l] << "\t" << rss[l] << "\t" << gcv[l] << endl;
+        }
+        cout << endl;
+    }
+
+    cout << "Selected lambda: " << lambdas[best] << endl;
+    cout << "Effective degrees of freedom: " << edf[best] << endl;
+    cout << "GCV score: " << gcv[best] << endl << endl;
+
+    // Residual degrees of freedom n - edf, rounded for the reporting routines
+    double dof = n - edf[best];
+    size_t nstar = (size_t)llround(dof) + k;
+
+    double RSS = CalculateRSS(x, y, coefbeta, w, n, k + 1);
+    double TSS = CalculateTSS(y, w, fixedinter, n);
+    double R2 = 1. - RSS / TSS;
+    double R2Adj = 1. - (fixedinter ? n : n - 1.) / dof * RSS / TSS;
+    double SE = (dof > 0.) ? sqrt(RSS / dof) : 0.;
+    double tstudentval = (dof > 0.) ? fabs(CalculateTValueStudent(dof, 1. - 0.5 * alphaval)) : 0.;
+    cout << "t-student value: " << tstudentval << endl << endl;
+
+    CalculateSERRBeta(fixedinter, SE, k, serbeta, XTWXInv);
+
+    DisplayPolynomial(k);
+    DisplayCoefs(k, nstar, tstudentval, coefbeta, serbeta);
+    DisplayStatistics(n, nstar, k, RSS, R2, R2Adj, SE);
+    WriteCIBands("CIBands2.dat", x, coefbeta, XTWXInv, tstudentval, SE, n, k);
+    DisplayCovCorrMatrix(k, SE, fixedinter, XTWXInv);
+
+    delete[] lambdas;
+    delete[] edf;
+    delete[] rss;
+    delete[] gcv;
+    delete[] coefbeta;
+    delete[] serbeta;
+    Free2DArray(XTWXInv, k + 1);
+
+}
+
+// Read the x, y, R_c and V_target columns of a csv file
+// **************************************************************
+bool ReadCSV(const std::string& filename, std::vector<double>& x_values, std::vector<double>& y_values,
+    std::vector<double>& rc_values, std::vector<double>& v_values) {
+
+    std::ifstream input(filename.c_str());
+    if (!input) {
+        perror("Error opening input file");
+        return false;
+    }
+
+    std::string line;
+    std::getline(input, line); // Skip the header
+
+    while (std::getline(input, line)) {
+        std::istringstream ss(line);
+        std::string token;
+        std::vector<double> values;
+        while (std::getline(ss, token, ',')) {
+            values.push_back(std::stod(token));
+        }
+        if (values.size() >= 4) {
+            x_values.push_back(values[0]);
+            y_values.push_back(values[1]);
+            rc_values.push_back(values[2]);
+            v_values.push_back(values[3]);
+        }
+    }
+
+    return true;
+
+}
+
+// Read the errors on y, one per line (first column of a csv file)
+// A first line that is not a number is taken as a header.
+// **************************************************************
+bool ReadSigma(const std::string& filename, std::vector<double>& sigma_values) {
+
+    std::ifstream input(filename.c_str());
+    if (!input) {
+        perror("Error opening sigma file");
+        return false;
+    }
+
+    std::string line;
+    bool first = true;
+    while (std::getline(input, line)) {
+        char* end = NULL;
+        double value = strtod(line.c_str(), &end);
+        if (end == line.c_str()) {
+            if (first) {
+                first = false;
+                continue;
+            }
+            if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+            cout << "Error reading sigma file " << filename << ": " << line << endl;
+            return false;
+        }
+        first = false;
+        sigma_values.push_back(value);
+    }
+
+    return true;
+
+}
+
+// Display the fit of one response: coefficients, statistics, covariance
+// and CI bands (CIBands_<name>.dat)
+// **************************************************************
+void DisplayResponseFit(const double* x, const double* y, const char* name, const size_t n, const size_t k,
+    const bool fixedinter, const double tstudentval, const double* w, const double* coefbeta, double** XTWXInv) {
+
+    size_t nstar = n - 1;
+    if (fixedinter) nstar = n;
+
+    double RSS = CalculateRSS(x, y, coefbeta, w, n, k + 1);
+    double TSS = CalculateTSS(y, w, fixedinter, n);
+    double R2 = 1. - RSS / TSS;
+    double dferr = n - (k + 1);
+    double dftot = n - 1;
+    if (fixedinter) {
+        dferr += 1.;
+        dftot += 1.;
+    }
+    double R2Adj = 1. - (dftot) / (dferr)*RSS / TSS;
+    double SE = 0.;
+    if ((nstar - k) > 0) SE = sqrt(RSS / (nstar - k));
+
+    double* serbeta = new double[k + 1];
+    CalculateSERRBeta(fixedinter, SE, k, serbeta, XTWXInv);
+    DisplayCoefs(k, nstar, tstudentval, coefbeta, serbeta);
+    DisplayStatistics(n, nstar, k, RSS, R2, R2Adj, SE);
+    DisplayANOVA(nstar, k, TSS, RSS);
+    WriteCIBands(std::string("CIBands_") + name + ".dat", x, coefbeta, XTWXInv, tstudentval, SE, n, k);
+    DisplayCovCorrMatrix(k, SE, fixedinter, XTWXInv);
+    delete[] serbeta;
+
+}
+
+// Fit m responses against the same x and display the results of each one
+// The responses with only finite values share one factorization of XTWX.
+// A response with non-finite values (inf in R_c) is fitted on its own
+// finite rows, and the number of dropped rows is reported.
+// **************************************************************
+void FitMultiResponse(const double* x, double** Y, const char* const* names, const size_t n, const size_t m,
+    const size_t k, const bool fixedinter, const double fixedinterval, const double alphaval, const double* w) {
+
+    size_t nstar = n - 1;
+    if (fixedinter) nstar = n;
+
+    std::vector<size_t> dropped(m, 0);               // Non-finite values of each response
+    std::vector<double*> shared;                     // Responses fitted together
+    for (size_t r = 0; r < m; r++) {
+        for (size_t i = 0; i < n; i++) {
+            if (!std::isfinite(Y[r][i])) dropped[r]++;
+        }
+        if (dropped[r] == 0) shared.push_back(Y[r]);
+    }
+
+    double** coefbeta = Make2DArray(m, k + 1);       // Coefficients of each response
+    double** XTWXInv = Make2DArray(k + 1, k + 1);    // Shared by the finite responses
+    double tstudentval = 0.;
+
+    if (!shared.empty()) {
+        PolyFit(x, shared.data(), n, shared.size(), k, fixedinter, fixedinterval, coefbeta, w, XTWXInv);
+
+        cout << "Matrix XTWXInv" << endl;
+        displayMat(XTWXInv, k + 1, k + 1);
+    }
+
+    if ((nstar - k) > 0) {
+        tstudentval = fabs(CalculateTValueStudent(nstar - k, 1. - 0.5 * alphaval));
+    }
+    cout << "t-student value: " << tstudentval << endl << endl;
+
+    DisplayPolynomial(k);
+
+    size_t s = 0;
+    for (size_t r = 0; r < m; r++) {
+
+        cout << "Response " << names[r] << endl;
+        cout << "**************************************************************" << endl;
+
+        if (dropped[r] == 0) {
+            DisplayResponseFit(x, Y[r], names[r], n, k, fixedinter, tstudentval, w, coefbeta[s++], XTWXInv);
+            continue;
+        }
+
+        // Fit of the finite rows only
+        std::vector<double> xf, yf, wf;
+        for (size_t i = 0; i < n; i++) {
+            if (!std::isfinite(Y[r][i])) continue;
+            xf.push_back(x[i]);
+            yf.push_back(Y[r][i]);
+            wf.push_back(w[i]);
+        }
+        size_t nf = xf.size();
+        size_t nfstar = fixedinter ? nf : nf - 1;
+        cout << "Column " << names[r] << ": " << dropped[r] << " non-finite values dropped, ";
+        cout << nf << " points fitted" << endl;
+        if (nf == 0 || k >= nfstar) {
+            cout << "Not enough finite values to fit " << names[r] << endl << endl;
+            continue;
+        }
+
+        double** coefresponse = Make2DArray(1, k + 1);
+        double** XTWXInvResponse = Make2DArray(k + 1, k + 1);
+        double* Yf[1] = { yf.data() };
+        PolyFit(xf.data(), Yf, nf, 1, k, fixedinter, fixedinterval, coefresponse, wf.data(), XTWXInvResponse);
+        double tresponse = fabs(CalculateTValueStudent(nfstar - k, 1. - 0.5 * alphaval));
+        cout << "t-student value: " << tresponse << endl << endl;
+        DisplayResponseFit(xf.data(), yf.data(), names[r], nf, k, fixedinter, tresponse, wf.data(), coefresponse[0],
+            XTWXInvResponse);
+        Free2DArray(coefresponse, 1);
+        Free2DArray(XTWXInvResponse, k + 1);
+
+    }
+
+    Free2DArray(coefbeta, m);
+    Free2DArray(XTWXInv, k + 1);
+
+}
+
+
+// Calculate the cumulative arc length s along the curve (x,y)
+// If closed is set, the segment joining the last point to the first one
+// is included in the returned total length. Returns the total length.
+// **************************************************************
+double CalculateArcLength(const double* x, const double* y, const size_t n, const bool closed, double* s) {
+
+    s[0] = 0.;
+    for (size_t i = 1; i < n; i++) {
+        double dx = x[i] - x[i - 1];
+        double dy = y[i] - y[i - 1];
+        s[i] = sqrt(dx * dx + dy * dy);
+    }
+    for (size_t i = 1; i < n; i++) {
+        s[i] += s[i - 1];
+    }
+
+    double length = s[n - 1];
+    if (closed) {
+        double dx = x[0] - x[n - 1];
+        double dy = y[0] - y[n - 1];
+        length += sqrt(dx * dx + dy * dy);
+    }
+
+    return length;
+
+}
+
+// Map the arc length s in [0,length] to the fit parameter u in [-1,1]
+// A symmetric interval keeps XTWX much better conditioned for high degrees.
+// **************************************************************
+void ArcLengthToParameter(const double* s, const size_t n, const double length, double* u) {
+
+    for (size_t i = 0; i < n; i++) {
+        u[i] = 2. * s[i] / length - 1.;
+    }
+
+}
+
+// Enforce p(1) = p(-1), p'(1) = p'(-1), ... up to nc continuity orders on
+// the m polynomials of beta[m][k+1]. The constrained solution and its
+// covariance are obtained from the unconstrained ones:
+//   beta_c = beta - G * (C * XTWXInv * CT)^-1 * C * beta,  G = XTWXInv * CT
+//   XTWXInv_c = XTWXInv - G * (C * XTWXInv * CT)^-1 * GT
+// Returns the number of constraints actually applied.
+// **************************************************************
+size_t ApplyPeriodicConstraints(double** beta, const size_t m, const size_t k, size_t nc, double** XTWXInv) {
+
+    if (nc > k) nc = k;
+    if (nc == 0) return 0;
+
+    double** C = Make2DArray(nc, k + 1);            // [nc,k+1]
+    double** G = Make2DArray(k + 1, nc);            // [k+1,nc]
+    double** M = Make2DArray(nc, nc);               // C*XTWXInv*CT
+    double** L = Make2DArray(nc, nc);
+    double* D = new double[nc];
+    double* Cb = new double[nc];
+    double* lambda = new double[nc];
+    double* col = new double[nc];
+
+    // Row d holds the d-th derivative of u^j at 1 minus at -1
+    for (size_t d = 0; d < nc; d++) {
+        for (size_t j = d; j < k + 1; j++) {
+            double falling = 1.;
+            for (size_t i = 0; i < d; i++) falling *= (double)(j - i);
+            C[d][j] = ((j - d) % 2 == 1) ? 2. * falling : 0.;
+        }
+    }
+
+    for (size_t i = 0; i < k + 1; i++) {
+        for (size_t d = 0; d < nc; d++) {
+            G[i][d] = 0.;
+            for (size_t j = 0; j < k + 1; j++) {
+                G[i][d] += XTWXInv[i][j] * C[d][j];
+            }
+        }
+    }
+
+    for (size_t d = 0; d < nc; d++) {
+        for (size_t e = 0; e < nc; e++) {
+            M[d][e] = 0.;
+            for (size_t j = 0; j < k + 1; j++) {
+                M[d][e] += C[d][j] * G[j][e];
+            }
+        }
+    }
+
+    if (!CholeskyDecomp(M, L, D, nc)) {
+        cout << "The periodicity constraints are degenerate and have been ignored" << endl;
+        nc = 0;
+    }
+    else {
+        for (size_t r = 0; r < m; r++) {
+            MatVectMul(nc, k + 1, C, beta[r], Cb);
+            CholeskySolve(L, D, Cb, lambda, nc);
+            for (size_t i = 0; i < k + 1; i++) {
+                for (size_t d = 0; d < nc; d++) {
+                    beta[r][i] -= G[i][d] * lambda[d];
+                }
+            }
+        }
+
+        for (size_t j = 0; j < k + 1; j++) {
+            for (size_t d = 0; d < nc; d++) Cb[d] = G[j][d];
+            CholeskySolve(L, D, Cb, col, nc);
+            for (size_t i = 0; i < k + 1; i++) {
+                for (size_t d = 0; d < nc; d++) {
+                    XTWXInv[i][j] -= G[i][d] * col[d];
+                }
+            }
+        }
+    }
+
+    Free2DArray(C, nc > 0 ? nc : 1);
+    Free2DArray(G, k + 1);
+    Free2DArray(M, nc > 0 ? nc : 1);
+    Free2DArray(L, nc > 0 ? nc : 1);
+    delete[] D;
+    delete[] Cb;
+    delete[] lambda;
+    delete[] col;
+
+    return nc;
+
+}
+
+// Evaluate the parametric curve (x(s),y(s)) at the n arc lengths s
+// Position, heading (rad) and signed curvature (1/m) are returned for
+// every query point.
+// **************************************************************
+void EvaluateParametricCurve(const double* coefx, const double* coefy, const size_t k, const double length,
+    const double* s, const size_t n, double* px, double* py, double* heading, double* curvature) {
+
+    double scale = 2. / length;                      // du/ds
+
+    for (size_t i = 0; i < n; i++) {
+        double u = scale * s[i] - 1.;
+        double dx, d2x, dy, d2y;
+        calculatePolyDerivs(u, coefx, k, &px[i], &dx, &d2x);
+        calculatePolyDerivs(u, coefy, k, &py[i], &dy, &d2y);
+        double speed2 = dx * dx + dy * dy;
+        heading[i] = atan2(dy, dx);
+        curvature[i] = (speed2 > 0.) ? (dx * d2y - dy * d2x) / (speed2 * sqrt(speed2)) : 0.;
+    }
+
+}
+
+// Write the fitted parametric curve in a file
+// **************************************************************
+void WriteParametricCurve(std::string filename, const double* coefx, const double* coefy, const size_t k,
+    const double length) {
+
+    const size_t npts = 101;
+    double s[npts], px[npts], py[npts], heading[npts], curvature[npts];
+
+    for (size_t i = 0; i < npts; i++) {
+        s[i] = length / (npts - 1) * i;
+    }
+
+    EvaluateParametricCurve(coefx, coefy, k, length, s, npts, px, py, heading, curvature);
+
+    ofstream output;
+    output.open(filename.c_str());
+    output << "s\tx\ty\theading\tcurvature";
+    for (size_t i = 0; i < npts; i++) {
+        output << endl << s[i] << "\t" << px[i] << "\t" << py[i] << "\t" << heading[i] << "\t" << curvature[i];
+    }
+    output.close();
+
+}
+
+// Fit the curve (x(s),y(s)) parametrized by its arc length
+// x and y are fitted as two responses sharing the same design. If periodic
+// is set, position, heading and curvature are forced to be continuous where
+// the loop closes. coefbeta[0] and coefbeta[1] receive the coefficients of
+// x(u) and y(u), u the parameter of every point and nc the number of
+// periodicity constraints. Returns the arc length.
+// **************************************************************
+double PolyFitParametric(const double* x, const double* y, const size_t n, const size_t k, const bool periodic,
+    const double* w, double* u, double** coefbeta, double** XTWXInv, size_t* nc) {
+
+    double* s = new double[n];
+    double* Y[2] = { (double*)x, (double*)y };
+
+    double length = CalculateArcLength(x, y, n, periodic, s);
+    ArcLengthToParameter(s, n, length, u);
+
+    PolyFit(u, Y, n, 2, k, false, 0., coefbeta, w, XTWXInv);
+
+    *nc = 0;
+    if (periodic) {
+        *nc = ApplyPeriodicConstraints(coefbeta, 2, k, 3, XTWXInv);
+    }
+
+    delete[] s;
+
+    return length;
+
+}
+
+// Fit the curve (x(s),y(s)) parametrized by its arc length and display the
+// results
+// **************************************************************
+void FitParametricCurve(const double* x, const double* y, const size_t n, const size_t k, const bool periodic,
+    const double alphaval, const double* w) {
+
+    double* u = new double[n];
+    double** coefbeta = Make2DArray(2, k + 1);       // Coefficients of x(u) and y(u)
+    double* serbeta = new double[k + 1];
+    double** XTWXInv = Make2DArray(k + 1, k + 1);
+    double* Y[2] = { (double*)x, (double*)y };
+    const char* names[2] = { "x(s)", "y(s)" };
+    double tstudentval = 0.;
+    size_t nc = 0;
+
+    double length = PolyFitParametric(x, y, n, k, periodic, w, u, coefbeta, XTWXInv, &nc);
+
+    cout << "Arc length: " << length << endl;
+    cout << "Parameter u = 2 s / " << length << " - 1" << endl << endl;
+
+    if (periodic) {
+        cout << "Periodicity constraints applied: " << nc << endl << endl;
+    }
+
+    size_t nstar = n - 1;
+    size_t dof = nstar - k + nc;
+    if (dof > 0) {
+        tstudentval = fabs(CalculateTValueStudent(dof, 1. - 0.5 * alphaval));
+    }
+
+    DisplayPolynomial(k);
+
+    for (size_t r = 0; r < 2; r++) {
+
+        double RSS = CalculateRSS(u, Y[r], coefbeta[r], w, n, k + 1);
+        double TSS = CalculateTSS(Y[r], w, false, n);
+        double R2 = 1. - RSS / TSS;
+        double R2Adj = 1. - (double)nstar / (double)dof * RSS / TSS;
+        double SE = (dof > 0) ? sqrt(RSS / dof) : 0.;
+
+        cout << "Response " << names[r] << endl;
+        cout << "**************************************************************" << endl;
+
+        CalculateSERRBeta(false, SE, k, serbeta, XTWXInv);
+        DisplayCoefs(k, nstar + nc, tstudentval, coefbeta[r], serbeta);
+        DisplayStatistics(n, nstar + nc, k, RSS, R2, R2Adj, SE);
+
+    }
+
+    WriteParametricCurve("Parametric.dat", coefbeta[0], coefbeta[1], k, length);
+
+    delete[] u;
+    delete[] serbeta;
+    Free2DArray(coefbeta, 2);
+    Free2DArray(XTWXInv, k + 1);
+
+}
+
+// Parametric polynomial curve (x(u),y(u)) with u in [umin,umax] and a
+// uniform grid over samples of the curve, used to answer nearest point
+// queries. The graph of y = p(x) is the curve x(u) = u, y(u) = p(u).
+// **************************************************************
+struct CurveIndex {
+    size_t k = 0;                                    // Degree of x(u) and y(u)
+    std::vector<double> coefx, coefy;                // Coefficients [k+1]
+    double umin = 0., umax = 1.;                     // Range of the parameter
+    bool periodic = false;                           // u wraps around instead of being clamped
+    std::vector<double> su, sx, sy;                  // Samples of the curve
+    double x0 = 0., y0 = 0., cell = 1.;              // Origin and cell size of the grid
+    size_t nx = 1, ny = 1;                           // Number of cells
+    std::vector<size_t> cellstart;                   // First sample of every cell [nx*ny+1]
+    std::vector<size_t> cellsamples;                 // Samples sorted by cell
+};
+
+// Sample the curve and bucket the samples in a uniform grid
+// **************************************************************
+void BuildCurveIndex(CurveIndex& index, const size_t nsamples) {
+
+    index.su.resize(nsamples);
+    index.sx.resize(nsamples);
+    index.sy.resize(nsamples);
+
+    double length = 0.;
+    double xmin = 1.e300, xmax = -1.e300, ymin = 1.e300, ymax = -1.e300;
+    for (size_t i = 0; i < nsamples; i++) {
+        double u = index.umin + (index.umax - index.umin) * i / (nsamples - 1.);
+        double d1, d2;
+        index.su[i] = u;
+        calculatePolyDerivs(u, index.coefx.data(), index.k, &index.sx[i], &d1, &d2);
+        calculatePolyDerivs(u, index.coefy.data(), index.k, &index.sy[i], &d1, &d2);
+        xmin = min(xmin, index.sx[i]);
+        xmax = max(xmax, index.sx[i]);
+        ymin = min(ymin, index.sy[i]);
+        ymax = max(ymax, index.sy[i]);
+        if (i > 0) {
+            length += sqrt((index.sx[i] - index.sx[i - 1]) * (index.sx[i] - index.sx[i - 1])
+                + (index.sy[i] - index.sy[i - 1]) * (index.sy[i] - index.sy[i - 1]));
+        }
+    }
+
+    // About four samples per cell along the curve
+    index.cell = max(4. * length / nsamples, 1.e-12 * (1. + (xmax - xmin) + (ymax - ymin)));
+    index.x0 = xmin;
+    index.y0 = ymin;
+    index.nx = (size_t)((xmax - xmin) / index.cell) + 1;
+    index.ny = (size_t)((ymax - ymin) / index.cell) + 1;
+
+    std::vector<size_t> cellof(nsamples);
+    index.cellstart.assign(index.nx * index.ny + 1, 0);
+    for (size_t i = 0; i < nsamples; i++) {
+        size_t cx = (size_t)((index.sx[i] - xmin) / index.cell);
+        size_t cy = (size_t)((index.sy[i] - ymin) / index.cell);
+        cellof[i] = min(cy, index.ny - 1) * index.nx + min(cx, index.nx - 1);
+        index.cellstart[cellof[i] + 1]++;
+    }
+    for (size_t c = 0; c < index.nx * index.ny; c++) {
+        index.cellstart[c + 1] += index.cellstart[c];
+    }
+    index.cellsamples.resize(nsamples);
+    std::vector<size_t> fill(index.cellstart.begin(), index.cellstart.end() - 1);
+    for (size_t i = 0; i < nsamples; i++) {
+        index.cellsamples[fill[cellof[i]]++] = i;
+    }
+
+}
+
+// Find the sample nearest to (px,py) by searching rings of cells of
+// increasing size around the cell of the point
+// **************************************************************
+size_t NearestSample(const CurveIndex& index, const double px, const double py) {
+
+    long cx = (long)floor((px - index.x0) / index.cell);
+    long cy = (long)floor((py - index.y0) / index.cell);
+    long nx = (long)index.nx;
+    long ny = (long)index.ny;
+
+    // Distance (in cells) from the point to the grid
+    long outside = max(max(-cx, cx - (nx - 1)), max(-cy, cy - (ny - 1)));
+    long rmax = max(nx, ny) + max(outside, 0L);
+
+    size_t best = 0;
+    double bestd2 = 1.e300;
+
+    for (long r = max(outside, 0L); r <= rmax; r++) {
+        for (long j = cy - r; j <= cy + r; j++) {
+            if (j < 0 || j >= ny) continue;
+            long step = (j == cy - r || j == cy + r) ? 1 : 2 * r;
+            for (long i = cx - r; i <= cx + r; i += (step > 0 ? step : 1)) {
+                if (i < 0 || i >= nx) continue;
+                size_t c = (size_t)(j * nx + i);
+                for (size_t s = index.cellstart[c]; s < index.cellstart[c + 1]; s++) {
+                    size_t id = index.cellsamples[s];
+                    double dx = index.sx[id] - px;
+                    double dy = index.sy[id] - py;
+                    double d2 = dx * dx + dy * dy;
+                    if (d2 < bestd2) {
+                        bestd2 = d2;
+                        best = id;
+                    }
+                }
+            }
+        }
+        // Every sample outside the ring is farther than r cells
+        double reach = r * index.cell;
+        if (bestd2 < 1.e300 && bestd2 <= reach * reach) break;
+    }
+
+    return best;
+
+}
+
+// Calculate the polynomial a of degree k and its first two derivatives at
+// the PROJECTLANES values t of a block, lane by lane (structure of arrays,
+// so the loops over the lanes vectorize)
+// **************************************************************
+#define PROJECTLANES 8
+
+inline void HornerDerivsLanes(const double* t, const double* a, const size_t k, double* p, double* dp,
+    double* d2p) {
+
+    const size_t L = PROJECTLANES;
+    for (size_t l = 0; l < L; l++) {
+        p[l] = 0.;
+        dp[l] = 0.;
+        d2p[l] = 0.;
+    }
+    for (size_t j = k + 1; j-- > 0;) {
+        for (size_t l = 0; l < L; l++) {
+            d2p[l] = d2p[l] * t[l] + dp[l];
+            dp[l] = dp[l] * t[l] + p[l];
+            p[l] = p[l] * t[l] + a[j];
+        }
+    }
+    for (size_t l = 0; l < L; l++) d2p[l] *= 2.;
+
+}
+
+// Project the nq points (px,py) on the curve
+// The initial guess is the nearest sample of the grid, refined by Newton
+// iterations on f(u) = |C(u) - P|^2 / 2 with f' = (C - P).C' and
+// f'' = C'.C' + (C - P).C''. u receives the parameter of the projection,
+// dist the distance to the curve and offset the signed lateral offset
+// (positive on the left of the direction of increasing u). The queries are
+// processed in blocks on all the cores, and within a block by groups of
+// PROJECTLANES iterated together: at most 20 iterations, with a mask that
+// freezes the converged lanes, until all the lanes of the group converge.
+// **************************************************************
+void ProjectPoints(const CurveIndex& index, const double* px, const double* py, const size_t nq,
+    double* u, double* dist, double* offset) {
+
+    const size_t L = PROJECTLANES;
+    const size_t blocksize = 1024;
+    const size_t nblocks = (nq + blocksize - 1) / blocksize;
+    const double range = index.umax - index.umin;
+    const double tol = 1.e-12 * range;
+
+    ParallelFor(nblocks, [&](size_t b) {
+        size_t q1 = min(nq, (b + 1) * blocksize);
+        for (size_t q0 = b * blocksize; q0 < q1; q0 += L) {
+
+            size_t count = min(L, q1 - q0);
+            double t[L], qx[L], qy[L], active[L];
+            double cx[L], dx[L], d2x[L], cy[L], dy[L], d2y[L];
+            for (size_t l = 0; l < L; l++) {
+                size_t q = q0 + min(l, count - 1);    // The padding lanes repeat the last query
+                qx[l] = px[q];
+                qy[l] = py[q];
+                t[l] = index.su[NearestSample(index, qx[l], qy[l])];
+                active[l] = 1.;
+            }
+
+            for (int it = 0; it < 20; it++) {
+                HornerDerivsLanes(t, index.coefx.data(), index.k, cx, dx, d2x);
+                HornerDerivsLanes(t, index.coefy.data(), index.k, cy, dy, d2y);
+                double converged = 1.;
+                for (size_t l = 0; l < L; l++) {
+                    double ex = cx[l] - qx[l];
+                    double ey = cy[l] - qy[l];
+                    double f1 = ex * dx[l] + ey * dy[l];
+                    double gn = dx[l] * dx[l] + dy[l] * dy[l];
+                    double f2 = gn + ex * d2x[l] + ey * d2y[l];
+                    f2 = (f2 > 0.) ? f2 : gn;            // Gauss-Newton step away from a maximum
+                    double step = (f2 > 0.) ? active[l] * f1 / f2 : 0.;
+                    active[l] = (fabs(step) >= tol) ? active[l] : 0.;
+                    t[l] -= step;
+                    converged = min(converged, 1. - active[l]);
+                }
+                if (index.periodic) {
+                    for (size_t l = 0; l < L; l++) {
+                        t[l] -= range * floor((t[l] - index.umin) / range);
+                    }
+                }
+                else {
+                    for (size_t l = 0; l < L; l++) t[l] = min(max(t[l], index.umin), index.umax);
+                }
+                if (converged == 1.) break;
+            }
+
+            HornerDerivsLanes(t, index.coefx.data(), index.k, cx, dx, d2x);
+            HornerDerivsLanes(t, index.coefy.data(), index.k, cy, dy, d2y);
+            for (size_t l = 0; l < count; l++) {
+                double ex = qx[l] - cx[l];
+                double ey = qy[l] - cy[l];
+                u[q0 + l] = t[l];
+                dist[q0 + l] = sqrt(ex * ex + ey * ey);
+                offset[q0 + l] = (dx[l] * ey - dy[l] * ex >= 0.) ? dist[q0 + l] : -dist[q0 + l];
+            }
+        }
+    });
+
+}
+
+// Read the first two columns of a csv file with a header line
+// **************************************************************
+bool ReadPoints(const std::string& filename, std::vector<double>& px, std::vector<double>& py) {
+
+    std::ifstream input(filename.c_str());
+    if (!input) {
+        perror("Error opening query file");
+        return false;
+    }
+
+    std::string line;
+    std::getline(input, line); // Skip the header
+
+    while (std::getline(input, line)) {
+        double a, b;
+        if (sscanf(line.c_str(), "%lf,%lf", &a, &b) == 2) {
+            px.push_back(a);
+            py.push_back(b);
+        }
+    }
+
+    return true;
+
+}
+
+// Fit the reference line and project the points of a query file on it
+// With parametric, the reference line is (x(s),y(s)) and the projected
+// parameter is the arc length s, otherwise it is y = p(x) and the projected
+// parameter is x. The results are written to Projection.dat.
+// **************************************************************
+void ProjectOnFit(const double* x, const double* y, const size_t n, const size_t k, const bool parametric,
+    const bool periodic, const double* w, const std::string& queryfile) {
+
+    std::vector<double> px, py;
+    if (!ReadPoints(queryfile, px, py)) return;
+    size_t nq = px.size();
+
+    CurveIndex index;
+    index.k = k;
+    double** coefbeta = Make2DArray(2, k + 1);
+    double** XTWXInv = Make2DArray(k + 1, k + 1);
+    double length = 0.;
+
+    if (parametric) {
+        double* u = new double[n];
+        size_t nc = 0;
+        length = PolyFitParametric(x, y, n, k, periodic, w, u, coefbeta, XTWXInv, &nc);
+        index.coefx.assign(coefbeta[0], coefbeta[0] + k + 1);
+        index.coefy.assign(coefbeta[1], coefbeta[1] + k + 1);
+        index.umin = -1.;
+        index.umax = 1.;
+        index.periodic = periodic;
+        delete[] u;
+    }
+    else {
+        double* Y[1] = { (double*)y };
+        PolyFit(x, Y, n, 1, k, false, 0., coefbeta, w, XTWXInv);
+        index.coefx.assign(k + 1, 0.);
+        if (k > 0) index.coefx[1] = 1.;
+        index.coefy.assign(coefbeta[0], coefbeta[0] + k + 1);
+        index.umin = *std::min_element(x, x + n);
+        index.umax = *std::max_element(x, x + n);
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    BuildCurveIndex(index, 4096);
+    auto t1 = std::chrono::steady_clock::now();
+
+    std::vector<double> u(nq), dist(nq), offset(nq);
+    ProjectPoints(index, px.data(), py.data(), nq, u.data(), dist.data(), offset.data());
+    auto t2 = std::chrono::steady_clock::now();
+
+    double tindex = std::chrono::duration<double>(t1 - t0).count();
+    double tquery = std::chrono::duration<double>(t2 - t1).count();
+
+    ofstream output;
+    output.open("Projection.dat");
+    output << "px\tpy\t" << (parametric ? "s" : "x") << "\tdistance\toffset";
+    for (size_t q = 0; q < nq; q++) {
+        double param = parametric ? (u[q] + 1.) * 0.5 * length : u[q];
+        output << endl << px[q] << "\t" << py[q] << "\t" << param << "\t" << dist[q] << "\t" << offset[q];
+    }
+    output.close();
+
+    double meandist = 0.;
+    for (size_t q = 0; q < nq; q++) meandist += dist[q];
+    if (nq > 0) meandist /= nq;
+
+    cout << "Projection of " << nq << " points" << endl;
+    cout << "Index: " << index.nx << " x " << index.ny << " cells, " << index.su.size() << " samples, ";
+    cout << tindex * 1000. << " ms" << endl;
+    cout << "Queries: " << tquery * 1000. << " ms, " << ((tquery > 0.) ? nq / tquery : 0.) << " queries/s" << endl;
+    cout << "Mean distance: " << meandist << endl;
+    cout << "Results written to Projection.dat" << endl;
+
+    Free2DArray(coefbeta, 2);
+    Free2DArray(XTWXInv, k + 1);
+
+}
+
+// Select target points so that the cumulative density cum[] is sampled at
+// uniform levels. cum must be non-decreasing. The first and last points are
+// always kept.
+// **************************************************************
+void SelectByDensity(const double* cum, const size_t n, const size_t target, std::vector<size_t>& idx) {
+
+    idx.clear();
+    idx.push_back(0);
+
+    double total = cum[n - 1] - cum[0];
+    size_t i = 0;
+    for (size_t j = 1; j + 1 < target; j++) {
+        double level = cum[0] + total * j / (target - 1.);
+        while (i < n - 1 && cum[i] < level) i++;
+        if (i > idx.back() && i < n - 1) idx.push_back(i);
+    }
+
+    if (n > 1) idx.push_back(n - 1);
+
+}
+
+// Weight every selected point by the total weight of the points it
+// represents, each point being represented by the nearest selected one
+// in the data order
+// **************************************************************
+void ReweightByCount(const std::vector<size_t>& idx, const double* w, const size_t n, double* wsub) {
+
+    size_t m = idx.size();
+    for (size_t j = 0; j < m; j++) {
+        size_t i0 = (j == 0) ? 0 : (idx[j - 1] + idx[j]) / 2 + 1;
+        size_t i1 = (j == m - 1) ? n : (idx[j] + idx[j + 1]) / 2 + 1;
+        wsub[j] = 0.;
+        for (size_t i = i0; i < i1; i++) wsub[j] += w[i];
+    }
+
+}
+
+// Decimate the n points (x,y) to about target points
+// type: 0 = uniform stride, 1 = uniform arc length, 2 = curvature adaptive,
+//       3 = leverage score sampling
+// The selected indices are returned in idx and their weights in wsub, so
+// that the weighted subset approximates the full weighted data set. For the
+// leverage scores, point i is kept with probability q_i, proportional to a
+// mix of its leverage and of the uniform density, and weighted by w_i/q_i.
+// **************************************************************
+void Decimate(const double* x, const double* y, const double* w, const size_t n, const size_t k,
+    const int type, const size_t target, std::vector<size_t>& idx, std::vector<double>& wsub) {
+
+    std::vector<double> cum(n, 0.);
+
+    switch (type) {
+        case 0:
+            for (size_t i = 0; i < n; i++) cum[i] = i;
+            break;
+        case 1:
+            CalculateArcLength(x, y, n, false, cum.data());
+            break;
+        case 2: {
+            // Density |kappa| + mean |kappa| per unit length, with the discrete
+            // (Menger) curvature of three consecutive points
+            std::vector<double> kappa(n, 0.), ds(n, 0.);
+            double meankappa = 0.;
+            for (size_t i = 1; i < n; i++) {
+                ds[i] = sqrt((x[i] - x[i - 1]) * (x[i] - x[i - 1]) + (y[i] - y[i - 1]) * (y[i] - y[i - 1]));
+            }
+            for (size_t i = 1; i + 1 < n; i++) {
+                double cross = (x[i] - x[i - 1]) * (y[i + 1] - y[i]) - (y[i] - y[i - 1]) * (x[i + 1] - x[i]);
+                double dx = x[i + 1] - x[i - 1];
+                double dy = y[i + 1] - y[i - 1];
+                double den = ds[i] * ds[i + 1] * sqrt(dx * dx + dy * dy);
+                kappa[i] = (den > 0.) ? 2. * fabs(cross) / den : 0.;
+                meankappa += kappa[i];
+            }
+            meankappa /= (n > 2) ? n - 2. : 1.;
+            for (size_t i = 1; i < n; i++) {
+                cum[i] = cum[i - 1] + (0.5 * (kappa[i - 1] + kappa[i]) + meankappa) * ds[i];
+            }
+            break;
+        }
+        case 3: {
+            double* Y[1] = { (double*)y };
+            double* beta[1] = { new double[k + 1] };
+            double** XTWXInv = Make2DArray(k + 1, k + 1);
+            std::vector<double> q(n), xp(k + 1);
+            std::mt19937_64 rng(12345);
+            std::uniform_real_distribution<double> uniform(0., 1.);
+
+            PolyFit(x, Y, n, 1, k, false, 0., beta, w, XTWXInv);
+
+            // Leverage h_i = w_i * xi^T * XTWXInv * xi, which sums to k+1
+            for (size_t i = 0; i < n; i++) {
+                double p = 1.;
+                for (size_t j = 0; j < k + 1; j++) {
+                    xp[j] = p;
+                    p *= x[i];
+                }
+                double h = 0.;
+                for (size_t j = 0; j < k + 1; j++) {
+                    for (size_t l = 0; l < k + 1; l++) h += xp[j] * XTWXInv[j][l] * xp[l];
+                }
+                h *= w[i];
+                q[i] = min(1., target * (0.5 * h / (k + 1.) + 0.5 / n));
+            }
+
+            idx.clear();
+            wsub.clear();
+            for (size_t i = 0; i < n; i++) {
+                if (uniform(rng) < q[i]) {
+                    idx.push_back(i);
+                    wsub.push_back(w[i] / q[i]);
+                }
+            }
+
+            delete[] beta[0];
+            Free2DArray(XTWXInv, k + 1);
+            return;
+        }
+    }
+
+    SelectByDensity(cum.data(), n, target, idx);
+    wsub.resize(idx.size());
+    ReweightByCount(idx, w, n, wsub.data());
+
+}
+
+// Fit a decimated subset of the data and compare it with the full fit
+// The coefficient deviation is given in units of the standard errors of the
+// full fit, and the RSS deviation is the relative increase of the RSS of the
+// full data set when the decimated coefficients are used. If tolerance > 0,
+// the target size is doubled until the RSS deviation is below tolerance.
+// **************************************************************
+void FitDecimated(const double* x, double* y, const double* w, const size_t n, const size_t k,
+    const bool fixedinter, const double fixedinterval, const int type, size_t target, const double tolerance) {
+
+    const char* methods[4] = { "uniform stride", "arc length", "curvature", "leverage" };
+    double* Y[1] = { y };
+    double* full[1] = { new double[k + 1] };
+    double* sub[1] = { new double[k + 1] };
+    double* serbeta = new double[k + 1];
+    double** XTWXInv = Make2DArray(k + 1, k + 1);
+    double** XTWXInvSub = Make2DArray(k + 1, k + 1);
+    std::vector<size_t> idx;
+    std::vector<double> wsub, xsub, ysub;
+
+    size_t nstar = n - 1;
+    if (fixedinter) nstar = n;
+
+    // Reference fit on the full data set
+    // **************************************************************
+    PolyFit(x, Y, n, 1, k, fixedinter, fixedinterval, full, w, XTWXInv);
+    double RSSfull = CalculateRSS(x, y, full[0], w, n, k + 1);
+    double SE = ((nstar - k) > 0) ? sqrt(RSSfull / (nstar - k)) : 0.;
+    CalculateSERRBeta(fixedinter, SE, k, serbeta, XTWXInv);
+
+    cout << "Decimation: " << methods[type] << endl;
+    cout << "Points\tFraction\tMax|dA|/StdErr\tRSS deviation" << endl;
+
+    double dcoef = 0.;
+    double drss = 0.;
+    while (true) {
+
+        Decimate(x, y, w, n, k, type, target, idx, wsub);
+
+        size_t m = idx.size();
+        xsub.resize(m);
+        ysub.resize(m);
+        for (size_t j = 0; j < m; j++) {
+            xsub[j] = x[idx[j]];
+            ysub[j] = y[idx[j]];
+        }
+
+        double* Ysub[1] = { ysub.data() };
+        PolyFit(xsub.data(), Ysub, m, 1, k, fixedinter, fixedinterval, sub, wsub.data(), XTWXInvSub);
+
+        dcoef = 0.;
+        for (size_t j = 0; j < k + 1; j++) {
+            if (serbeta[j] > 0.) dcoef = max(dcoef, fabs(sub[0][j] - full[0][j]) / serbeta[j]);
+        }
+        drss = CalculateRSS(x, y, sub[0], w, n, k + 1) / RSSfull - 1.;
+
+        cout << m << "\t" << (double)m / n << "\t" << dcoef << "\t" << drss << endl;
+
+        if (tolerance <= 0. || drss <= tolerance || target >= n) break;
+        target = min(n, 2 * target);
+    }
+    cout << endl;
+
+    cout << "Coeff\tFull\tDecimated" << endl;
+    for (size_t j = 0; j < k + 1; j++) {
+        cout << "A" << j << "\t" << full[0][j] << "\t" << sub[0][j] << endl;
+    }
+    cout << endl;
+
+    delete[] full[0];
+    delete[] sub[0];
+    delete[] serbeta;
+    Free2DArray(XTWXInv, k + 1);
+    Free2DArray(XTWXInvSub, k + 1);
+
+}
+
+// Piecewise polynomial: segment s covers [breaks[s],breaks[s+1]] and is a
+// polynomial of degree k in the local variable v = (t - center) / halfwidth,
+// so that v is in [-1,1] on every segment. The coefficients of response r
+// on segment s start at coefs[(s * m + r) * (k + 1)].
+// **************************************************************
+struct PiecewisePoly {
+    size_t k = 0;                                    // Degree of the segments
+    size_t m = 0;                                    // Number of responses
+    std::vector<double> breaks;                      // Segment boundaries [nseg+1]
+    std::vector<double> coefs;                       // Coefficients [nseg][m][k+1]
+};
+
+// Find the segment containing t with a binary search on the breakpoints
+// Values outside the fitted range are assigned to the first/last segment.
+// **************************************************************
+size_t FindSegment(const PiecewisePoly& pp, const double t) {
+
+    size_t nseg = pp.breaks.size() - 1;
+    size_t seg = std::upper_bound(pp.breaks.begin() + 1, pp.breaks.end() - 1, t) - (pp.breaks.begin() + 1);
+    return min(seg, nseg - 1);
+
+}
+
+// Calculate response r of the piecewise polynomial at t
+// **************************************************************
+double EvaluatePiecewise(const PiecewisePoly& pp, const size_t r, const double t) {
+
+    size_t seg = FindSegment(pp, t);
+    double center = 0.5 * (pp.breaks[seg] + pp.breaks[seg + 1]);
+    double halfwidth = 0.5 * (pp.breaks[seg + 1] - pp.breaks[seg]);
+    const double* a = &pp.coefs[(seg * pp.m + r) * (pp.k + 1)];
+
+    double v = (t - center) / halfwidth;
+    double poly = a[pp.k];
+    for (size_t i = pp.k; i-- > 0;) {
+        poly = poly * v + a[i];
+    }
+
+    return poly;
+
+}
+
+// Accumulate XTWX and XTWY of the points [i0,i1) in the local variable
+// v = (t - center) / halfwidth
+// **************************************************************
+void AccumulateSegment(const double* t, double** Y, const double* w, const size_t i0, const size_t i1,
+    const size_t m, const size_t k, const double center, const double halfwidth, double** XTWX, double** XTWY) {
+
+    double* S = new double[2 * k + 1];
+    double* xp = new double[k + 1];
+
+    for (size_t j = 0; j < 2 * k + 1; j++) S[j] = 0.;
+    for (size_t r = 0; r < m; r++) {
+        for (size_t j = 0; j < k + 1; j++) XTWY[r][j] = 0.;
+    }
+
+    for (size_t i = i0; i < i1; i++) {
+        double v = (t[i] - center) / halfwidth;
+        double p = w[i];
+        for (size_t j = 0; j < 2 * k + 1; j++) {
+            if (j < k + 1) xp[j] = p;
+            S[j] += p;
+            p *= v;
+        }
+        for (size_t r = 0; r < m; r++) {
+            for (size_t j = 0; j < k + 1; j++) {
+                XTWY[r][j] += xp[j] * Y[r][i];
+            }
+        }
+    }
+
+    for (size_t j = 0; j < k + 1; j++) {
+        for (size_t l = 0; l < k + 1; l++) {
+            XTWX[j][l] = S[j + l];
+        }
+    }
+
+    delete[] S;
+    delete[] xp;
+
+}
+
+// Fit the points [i0,i1) independently of the other segments
+// coefs receives the m * (k+1) coefficients and the weighted RSS summed
+// over the responses is returned (negative if XTWX is singular).
+// **************************************************************
+double FitSegment(const double* t, double** Y, const double* w, const size_t i0, const size_t i1,
+    const size_t m, const size_t k, const double center, const double halfwidth, double* coefs) {
+
+    double** XTWX = Make2DArray(k + 1, k + 1);
+    double** L = Make2DArray(k + 1, k + 1);
+    double** XTWY = Make2DArray(m, k + 1);
+    double* D = new double[k + 1];
+    double RSS = -1.;
+
+    AccumulateSegment(t, Y, w, i0, i1, m, k, center, halfwidth, XTWX, XTWY);
+
+    if (CholeskyDecomp(XTWX, L, D, k + 1)) {
+        RSS = 0.;
+        for (size_t r = 0; r < m; r++) {
+            double* a = coefs + r * (k + 1);
+            CholeskySolve(L, D, XTWY[r], a, k + 1);
+            for (size_t i = i0; i < i1; i++) {
+                double v = (t[i] - center) / halfwidth;
+                double poly = a[k];
+                for (size_t j = k; j-- > 0;) poly = poly * v + a[j];
+                RSS += w[i] * (Y[r][i] - poly) * (Y[r][i] - poly);
+            }
+        }
+    }
+
+    Free2DArray(XTWX, k + 1);
+    Free2DArray(L, k + 1);
+    Free2DArray(XTWY, m);
+    delete[] D;
+
+    return RSS;
+
+}
+
+// Choose up to maxseg segments by recursive splitting of the segment with
+// the largest RSS. Every segment keeps at least 2*(k+1) points. t must be
+// sorted in increasing order. A segment is split at the index nearest to
+// its middle where t changes, so that the breakpoint lies strictly between
+// two points; a segment of equal t values is not split.
+// **************************************************************
+void AutoBreakpoints(const double* t, double** Y, const double* w, const size_t n, const size_t m,
+    const size_t k, const size_t maxseg, std::vector<double>& breaks) {
+
+    const size_t minpts = 2 * (k + 1);
+    std::vector<size_t> start(1, 0);                 // First point of every segment
+    std::vector<double> rss(1, 0.);
+    std::vector<char> whole(1, 0);                   // Segment with no valid split
+    std::vector<double> coefs(m * (k + 1));
+
+    auto fit = [&](const size_t i0, const size_t i1) {
+        double halfwidth = 0.5 * (t[i1 - 1] - t[i0]);
+        if (!(halfwidth > 0.)) halfwidth = 1.;
+        return FitSegment(t, Y, w, i0, i1, m, k, 0.5 * (t[i0] + t[i1 - 1]), halfwidth, coefs.data());
+    };
+
+    start.push_back(n);
+    rss[0] = fit(0, n);
+
+    while (rss.size() < maxseg) {
+
+        // Select the worst segment which can still be split
+        size_t worst = rss.size();
+        for (size_t s = 0; s < rss.size(); s++) {
+            if (whole[s] || start[s + 1] - start[s] < 2 * minpts) continue;
+            if (worst == rss.size() || rss[s] > rss[worst]) worst = s;
+        }
+        if (worst == rss.size() || rss[worst] <= 0.) break;
+
+        // Nearest split to the middle between two different t values
+        size_t first = start[worst] + minpts;
+        size_t last = start[worst + 1] - minpts;
+        size_t half = (start[worst] + start[worst + 1]) / 2;
+        size_t mid = 0;
+        for (size_t d = 0; half + d <= last || half >= first + d; d++) {
+            if (half + d <= last && t[half + d - 1] < t[half + d]) {
+                mid = half + d;
+                break;
+            }
+            if (half >= first + d && t[half - d - 1] < t[half - d]) {
+                mid = half - d;
+                break;
+            }
+        }
+        if (mid == 0) {
+            whole[worst] = 1;
+            continue;
+        }
+
+        start.insert(start.begin() + worst + 1, mid);
+        rss.insert(rss.begin() + worst + 1, 0.);
+        whole.insert(whole.begin() + worst + 1, 0);
+
+        for (size_t s = worst; s <= worst + 1; s++) rss[s] = fit(start[s], start[s + 1]);
+    }
+
+    breaks.clear();
+    breaks.push_back(t[0]);
+    for (size_t s = 1; s + 1 < start.size(); s++) {
+        breaks.push_back(0.5 * (t[start[s] - 1] + t[start[s]]));
+    }
+    breaks.push_back(t[n - 1]);
+
+}
+
+// Fit the m responses Y[m][n] with a piecewise polynomial of degree k on the
+// given breakpoints. t must be sorted in increasing order. The segments are
+// accumulated in parallel. If continuity >= 0, the value and the first
+// continuity derivatives are forced to match at every interior breakpoint;
+// the constrained problem is solved as one banded KKT system with the
+// unknowns ordered [beta_0, lambda_0, beta_1, lambda_1, ...], factored once
+// for all the responses. Returns false if the system is singular.
+// **************************************************************
+bool PolyFitSegmented(const double* t, double** Y, const double* w, const size_t n, const size_t m,
+    const size_t k, const std::vector<double>& breaks, const int continuity, PiecewisePoly& pp) {
+
+    const size_t nseg = breaks.size() - 1;
+    const size_t K = k + 1;
+    const size_t C = (continuity >= 0) ? min((size_t)continuity, k) + 1 : 0;
+
+    pp.k = k;
+    pp.m = m;
+    pp.breaks = breaks;
+    pp.coefs.assign(nseg * m * K, 0.);
+
+    std::vector<size_t> start(nseg + 1);
+    for (size_t s = 0; s < nseg; s++) {
+        start[s] = std::lower_bound(t, t + n, breaks[s]) - t;
+    }
+    start[0] = 0;
+    start[nseg] = n;
+
+    std::vector<double> center(nseg), halfwidth(nseg);
+    for (size_t s = 0; s < nseg; s++) {
+        center[s] = 0.5 * (breaks[s] + breaks[s + 1]);
+        halfwidth[s] = 0.5 * (breaks[s + 1] - breaks[s]);
+    }
+
+    // Independent segments
+    // **************************************************************
+    if (C == 0) {
+        std::atomic<bool> ok(true);
+        ParallelFor(nseg, [&](size_t s) {
+            if (FitSegment(t, Y, w, start[s], start[s + 1], m, k, center[s], halfwidth[s],
+                &pp.coefs[s * m * K]) < 0.) ok = false;
+        });
+        return ok;
+    }
+
+    // Continuous segments: accumulate every segment in parallel
+    // **************************************************************
+    std::vector<double**> XTWX(nseg), XTWY(nseg);
+    ParallelFor(nseg, [&](size_t s) {
+        XTWX[s] = Make2DArray(K, K);
+        XTWY[s] = Make2DArray(m, K);
+        AccumulateSegment(t, Y, w, start[s], start[s + 1], m, k, center[s], halfwidth[s], XTWX[s], XTWY[s]);
+    });
+
+    // Assemble the banded KKT matrix
+    // **************************************************************
+    const size_t block = K + C;
+    const size_t N = nseg * K + (nseg - 1) * C;
+    const size_t kl = K + C - 1;
+    const size_t ku = K + C - 1;
+
+    double** ab = Make2DArray(N, 2 * kl + ku + 1);
+    double** lower = Make2DArray(N, kl);
+    size_t* piv = new size_t[N];
+
+    for (size_t s = 0; s < nseg; s++) {
+        size_t o = s * block;
+        for (size_t i = 0; i < K; i++) {
+            for (size_t j = 0; j < K; j++) {
+                ab[o + i][(o + j) - (o + i) + kl] = XTWX[s][i][j];
+            }
+        }
+        if (s + 1 == nseg) continue;
+
+        // d-th derivative at the right end of s minus at the left end of s+1
+        double hbar = 0.5 * (halfwidth[s] + halfwidth[s + 1]);
+        for (size_t d = 0; d < C; d++) {
+            size_t row = o + K + d;
+            double sl = pow(hbar / halfwidth[s], d);
+            double sr = pow(hbar / halfwidth[s + 1], d);
+            for (size_t j = d; j < K; j++) {
+                double falling = 1.;
+                for (size_t i = 0; i < d; i++) falling *= (double)(j - i);
+                double cl = falling * sl;
+                double cr = -falling * (((j - d) % 2 == 1) ? -1. : 1.) * sr;
+                size_t jl = o + j;
+                size_t jr = o + block + j;
+                ab[row][jl - row + kl] = cl;
+                ab[jl][row - jl + kl] = cl;
+                ab[row][jr - row + kl] = cr;
+                ab[jr][row - jr + kl] = cr;
+            }
+        }
+    }
+
+    bool ok = BandLUDecomp(ab, lower, piv, N, kl, ku);
+
+    if (ok) {
+        double* b = new double[N];
+        double* sol = new double[N];
+        for (size_t r = 0; r < m; r++) {
+            for (size_t i = 0; i < N; i++) b[i] = 0.;
+            for (size_t s = 0; s < nseg; s++) {
+                for (size_t j = 0; j < K; j++) b[s * block + j] = XTWY[s][r][j];
+            }
+            BandLUSolve(ab, lower, piv, N, kl, ku, b, sol);
+            for (size_t s = 0; s < nseg; s++) {
+                for (size_t j = 0; j < K; j++) pp.coefs[(s * m + r) * K + j] = sol[s * block + j];
+            }
+        }
+        delete[] b;
+        delete[] sol;
+    }
+
+    for (size_t s = 0; s < nseg; s++) {
+        Free2DArray(XTWX[s], K);
+        Free2DArray(XTWY[s], m);
+    }
+    Free2DArray(ab, N);
+    Free2DArray(lower, N);
+    delete[] piv;
+
+    return ok;
+
+}
+
+// Fit the m responses Y[m][n] against t with a piecewise polynomial and
+// display the results. The points are sorted by t first. If breaks is empty,
+// up to maxseg breakpoints are found automatically. The fit is copied to
+// result if given. Returns false if the breakpoints are invalid (outside
+// the range of t or repeated), a segment has too few points or the fit is
+// singular.
+// **************************************************************
+bool FitSegmentedCurve(const double* t, double** Y, const char* const* names, const size_t n, const size_t m,
+    const size_t k, std::vector<double> breaks, const size_t maxseg, const int continuity, const double* w,
+    PiecewisePoly* result = NULL) {
+
+    // Sort the points by t
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return t[a] < t[b]; });
+
+    double* ts = new double[n];
+    double* ws = new double[n];
+    double** Ys = Make2DArray(m, n);
+    for (size_t i = 0; i < n; i++) {
+        ts[i] = t[order[i]];
+        ws[i] = w[order[i]];
+        for (size_t r = 0; r < m; r++) Ys[r][i] = Y[r][order[i]];
+    }
+
+    bool valid = true;
+    if (breaks.empty()) {
+        AutoBreakpoints(ts, Ys, ws, n, m, k, maxseg, breaks);
+    }
+    else {
+        for (size_t b = 0; b < breaks.size() && valid; b++) {
+            if (breaks[b] <= ts[0] || breaks[b] >= ts[n - 1]) {
+                cout << "Breakpoint " << breaks[b] << " is outside the range of the data (";
+                cout << ts[0] << ", " << ts[n - 1] << ")" << endl;
+                valid = false;
+            }
+            else if (b > 0 && breaks[b] == breaks[b - 1]) {
+                cout << "Breakpoint " << breaks[b] << " is repeated" << endl;
+                valid = false;
+            }
+        }
+        breaks.insert(breaks.begin(), ts[0]);
+        breaks.push_back(ts[n - 1]);
+    }
+
+    // Every segment needs enough points for the coefficients left free by
+    // the continuity constraints at its joints (and at least one point)
+    size_t nseg = breaks.size() - 1;
+    for (size_t s = 0; s < nseg && valid; s++) {
+        size_t i0 = std::lower_bound(ts, ts + n, breaks[s]) - ts;
+        size_t i1 = (s + 1 == nseg) ? n : std::lower_bound(ts, ts + n, breaks[s + 1]) - ts;
+        size_t joints = (s > 0 ? 1 : 0) + (s + 1 < nseg ? 1 : 0);
+        size_t constraints = (continuity >= 0) ? joints * (min((size_t)continuity, k) + 1) : 0;
+        size_t needed = (k + 1 > constraints) ? k + 1 - constraints : 1;
+        if (i1 - i0 < needed) {
+            cout << "Segment " << s << " [" << breaks[s] << ", " << breaks[s + 1] << "] has " << i1 - i0;
+            cout << " points, " << needed << " needed for degree " << k;
+            if (continuity >= 0) cout << " with C" << continuity << " continuity";
+            cout << endl;
+            valid = false;
+        }
+    }
+
+    PiecewisePoly pp;
+    if (!valid) {
+        cout << "Segmented fit not done. Program stopped" << endl;
+    }
+    else if (!PolyFitSegmented(ts, Ys, ws, n, m, k, breaks, continuity, pp)) {
+        cout << "The segmented fit is singular. Use fewer segments or a lower degree." << endl;
+        valid = false;
+    }
+    else {
+        cout << "Segmented fit: " << nseg << " segments of degree " << k;
+        if (continuity >= 0) cout << ", C" << continuity << " continuity";
+        cout << endl << endl;
+
+        cout << "Seg\tStart\tEnd\tPoints";
+        for (size_t r = 0; r < m; r++) cout << "\tRSS " << names[r];
+        cout << endl;
+
+        std::vector<double> RSS(m, 0.);
+        size_t i = 0;
+        for (size_t s = 0; s < nseg; s++) {
+            size_t i0 = i;
+            std::vector<double> rss(m, 0.);
+            while (i < n && (s + 1 == nseg || ts[i] < breaks[s + 1])) {
+                for (size_t r = 0; r < m; r++) {
+                    double ri = Ys[r][i] - EvaluatePiecewise(pp, r, ts[i]);
+                    rss[r] += ws[i] * ri * ri;
+                }
+                i++;
+            }
+            cout << s << "\t" << breaks[s] << "\t" << breaks[s + 1] << "\t" << i - i0;
+            for (size_t r = 0; r < m; r++) {
+                cout << "\t" << rss[r];
+                RSS[r] += rss[r];
+            }
+            cout << endl;
+        }
+        cout << endl;
+
+        for (size_t r = 0; r < m; r++) {
+            double TSS = CalculateTSS(Ys[r], ws, false, n);
+            cout << "Response " << names[r] << endl;
+            cout << "Residual sum of squares: " << RSS[r] << endl;
+            cout << "R-square (COD): " << 1. - RSS[r] / TSS << endl << endl;
+        }
+
+        ofstream output;
+        output.open("Piecewise.dat");
+        output << "t\tsegment";
+        for (size_t r = 0; r < m; r++) output << "\t" << names[r];
+        for (size_t s = 0; s < nseg; s++) {
+            for (size_t j = 0; j <= 20; j++) {
+                double tj = breaks[s] + (breaks[s + 1] - breaks[s]) / 20. * j;
+                output << endl << tj << "\t" << s;
+                for (size_t r = 0; r < m; r++) output << "\t" << EvaluatePiecewise(pp, r, tj);
+            }
+        }
+        output.close();
+
+        if (result) *result = pp;
+    }
+
+    delete[] ts;
+    delete[] ws;
+    Free2DArray(Ys, m);
+
+    return valid;
+
+}
+
+// Calculate the coefficients of all the derivatives of the polynomial a of
+// degree k in one pass: derivs[j] holds the k-j+1 coefficients of p^(j)
+// **************************************************************
+void DifferentiatePoly(const double* a, const size_t k, std::vector<std::vector<double> >& derivs) {
+
+    derivs.resize(k + 1);
+    derivs[0].assign(a, a + k + 1);
+    for (size_t j = 1; j <= k; j++) {
+        derivs[j].resize(k - j + 1);
+        for (size_t i = 0; i < k - j + 1; i++) {
+            derivs[j][i] = (i + 1) * derivs[j - 1][i + 1];
+        }
+    }
+
+}
+
+// Calculate a polynomial of degree deg with Horner's scheme
+// **************************************************************
+double HornerPoly(const double x, const double* a, const size_t deg) {
+
+    double poly = a[deg];
+    for (size_t i = deg; i-- > 0;) {
+        poly = poly * x + a[i];
+    }
+    return poly;
+
+}
+
+// Find the root of f = p - level in [l,r] where f(l) and f(r) have opposite
+// signs, with Newton steps safeguarded by bisection. dp holds p'.
+// **************************************************************
+double PolishRoot(const double* p, const double* dp, const size_t deg, const double level, double l, double r,
+    double fl) {
+
+    double t = 0.5 * (l + r);
+    for (int it = 0; it < MAXIT; it++) {
+        double f = HornerPoly(t, p, deg) - level;
+        if (f == 0.) return t;
+        if ((f < 0.) == (fl < 0.)) {
+            l = t;
+            fl = f;
+        }
+        else {
+            r = t;
+        }
+        double df = (deg > 0) ? HornerPoly(t, dp, deg - 1) : 0.;
+        double tn = (df != 0.) ? t - f / df : l - 1.;
+        if (tn <= l || tn >= r) tn = 0.5 * (l + r);    // Bisection if Newton leaves the bracket
+        if (fabs(tn - t) <= 1.e-15 * (1. + fabs(t)) || r - l <= 1.e-15 * (1. + fabs(t))) return tn;
+        t = tn;
+    }
+    return t;
+
+}
+
+// Find the real roots of p^(j) in [a,b] for j = 0 (p - level), 1 and 2
+// The roots of p^(j+1) split [a,b] in intervals where p^(j) is monotone, so
+// each interval holds at most one root of p^(j), found by PolishRoot. The
+// cascade starts from the constant p^(k) and goes down to p, using the
+// derivative coefficients of DifferentiatePoly. roots[j] receives the
+// sorted roots of p^(j) for j = 0, 1, 2.
+// **************************************************************
+void PolyRealRoots(const std::vector<std::vector<double> >& derivs, const double level, const double a,
+    const double b, std::vector<double> roots[3]) {
+
+    size_t k = derivs.size() - 1;
+    std::vector<double> upper, current;             // Roots of p^(j+1) and p^(j)
+
+    for (size_t j = k; j-- > 0;) {
+
+        const double* p = derivs[j].data();
+        const double* dp = derivs[j + 1].data();
+        size_t deg = k - j;
+        double lev = (j == 0) ? level : 0.;
+        double scale = fabs(lev);
+        for (size_t i = 0; i <= deg; i++) scale += fabs(p[i]) * pow(max(fabs(a), fabs(b)), (double)i);
+        double eps = 1.e-13 * scale;
+
+        std::vector<double> points;
+        points.push_back(a);
+        points.insert(points.end(), upper.begin(), upper.end());
+        points.push_back(b);
+
+        current.clear();
+        double fl = HornerPoly(a, p, deg) - lev;
+        if (fabs(fl) <= eps) current.push_back(a);
+        for (size_t i = 0; i + 1 < points.size(); i++) {
+            double l = points[i];
+            double r = points[i + 1];
+            double fr = HornerPoly(r, p, deg) - lev;
+            if (fabs(fr) <= eps) {
+                // Root at a critical point (double root) or at b
+                if (current.empty() || r - current.back() > 1.e-12 * (b - a)) current.push_back(r);
+            }
+            else if (fabs(fl) > eps && (fl < 0.) != (fr < 0.)) {
+                current.push_back(PolishRoot(p, dp, deg, lev, l, r, fl));
+            }
+            fl = fr;
+        }
+
+        if (j <= 2) roots[j] = current;
+        upper.swap(current);
+    }
+
+}
+
+// One root found on a fitted curve
+// **************************************************************
+struct CurveRoot {
+    size_t response;
+    size_t segment;
+    int type;                                        // 0 = level crossing, 1 = minimum, 2 = maximum, 3 = inflection
+    double t;
+    double value;
+};
+
+// Find the level crossings, the extrema and the inflection points of every
+// response on every segment of the piecewise polynomial, in parallel over
+// the segments
+// **************************************************************
+void FindCurveRoots(const PiecewisePoly& pp, const double level, const bool findlevel,
+    std::vector<CurveRoot>& results) {
+
+    size_t nseg = pp.breaks.size() - 1;
+    std::vector<std::vector<CurveRoot> > found(nseg);
+
+    ParallelFor(nseg, [&](size_t s) {
+        double center = 0.5 * (pp.breaks[s] + pp.breaks[s + 1]);
+        double halfwidth = 0.5 * (pp.breaks[s + 1] - pp.breaks[s]);
+        std::vector<std::vector<double> > derivs;
+        std::vector<double> roots[3];
+
+        for (size_t r = 0; r < pp.m; r++) {
+            DifferentiatePoly(&pp.coefs[(s * pp.m + r) * (pp.k + 1)], pp.k, derivs);
+            PolyRealRoots(derivs, level, -1., 1., roots);
+
+            for (size_t j = 0; j < 3; j++) {
+                if (j == 0 && !findlevel) continue;
+                for (size_t i = 0; i < roots[j].size(); i++) {
+                    double v = roots[j][i];
+                    CurveRoot root;
+                    root.response = r;
+                    root.segment = s;
+                    root.t = center + halfwidth * v;
+                    root.value = HornerPoly(v, derivs[0].data(), pp.k);
+                    if (j == 0) root.type = 0;
+                    else if (j == 2) root.type = 3;
+                    else root.type = (pp.k >= 2 && HornerPoly(v, derivs[2].data(), pp.k - 2) < 0.) ? 2 : 1;
+                    found[s].push_back(root);
+                }
+            }
+        }
+    });
+
+    results.clear();
+    for (size_t s = 0; s < nseg; s++) {
+        results.insert(results.end(), found[s].begin(), found[s].end());
+    }
+
+}
+
+// Find and write the roots of the piecewise polynomial to Roots.dat
+// **************************************************************
+void WriteCurveRoots(const PiecewisePoly& pp, const char* const* names, const double level, const bool findlevel) {
+
+    const char* types[4] = { "level", "minimum", "maximum", "inflection" };
+    std::vector<CurveRoot> results;
+    size_t count[4] = { 0, 0, 0, 0 };
+
+    auto t0 = std::chrono::steady_clock::now();
+    FindCurveRoots(pp, level, findlevel, results);
+    auto t1 = std::chrono::steady_clock::now();
+
+    ofstream output;
+    output.open("Roots.dat");
+    output << std::setprecision(12);
+    output << "response\tsegment\ttype\tt\tvalue";
+    for (size_t i = 0; i < results.size(); i++) {
+        const CurveRoot& root = results[i];
+        output << endl << names[root.response] << "\t" << root.segment << "\t" << types[root.type];
+        output << "\t" << root.t << "\t" << root.value;
+        count[root.type]++;
+    }
+    output.close();
+
+    cout << "Roots of " << pp.breaks.size() - 1 << " segments found in ";
+    cout << std::chrono::duration<double>(t1 - t0).count() * 1000. << " ms" << endl;
+    if (findlevel) cout << "Crossings of " << level << ": " << count[0] << endl;
+    cout << "Minima: " << count[1] << endl;
+    cout << "Maxima: " << count[2] << endl;
+    cout << "Inflection points: " << count[3] << endl;
+    cout << "Results written to Roots.dat" << endl;
+
+}
+
+// Lookup table of uniform cubic Hermite cells for response r at x:
+// the local variable of cell i is u = (x - xmin) * invh - i in [0,1]
+// **************************************************************
+struct LookupTable {
+    size_t m = 0;                                    // Number of responses
+    size_t ncell = 0;                                // Number of cells
+    double xmin = 0.;                                // Range of the table
+    double xmax = 0.;
+    double invh = 0.;                                // Inverse cell width
+    double maxerr = 0.;                              // Verified max absolute error
+    std::vector<double> coefs;                       // Cubic coefficients [ncell][m][4]
+};
+
+// Header of the binary lookup table, followed by the coefficients
+// The file is written in the native byte order (little-endian on x86 and
+// ARM); the magic ends with the format version (01).
+// **************************************************************
+struct LookupHeader {
+    char magic[8];                                   // "PFLUT01\0"
+    uint64_t m;
+    uint64_t ncell;
+    double xmin;
+    double xmax;
+    double invh;
+    double maxerr;
+};
+static_assert(sizeof(LookupHeader) == 56, "The lookup header is 56 bytes with no padding");
+
+// Calculate response r of the lookup table at x
+// The index is clamped without branches, so values outside the range are
+// extrapolated from the first/last cell.
+// **************************************************************
+inline double EvaluateLookup(const LookupTable& lut, const size_t r, const double x) {
+
+    double u = min(max((x - lut.xmin) * lut.invh, 0.), (double)lut.ncell);
+    size_t i = min((size_t)(long long)u, lut.ncell - 1);
+    double t = u - (double)i;
+    const double* c = &lut.coefs[(i * lut.m + r) * 4];
+    return ((c[3] * t + c[2]) * t + c[1]) * t + c[0];
+
+}
+
+// Calculate the coefficients q of a(alpha + beta * t), where a has degree k
+// **************************************************************
+void ComposeAffine(const double* a, const size_t k, const double alpha, const double beta, double* q) {
+
+    q[0] = a[k];
+    for (size_t i = 1; i <= k; i++) q[i] = 0.;
+    for (size_t i = k; i-- > 0;) {
+        for (size_t j = k; j > 0; j--) {
+            q[j] = alpha * q[j] + beta * q[j - 1];
+        }
+        q[0] = alpha * q[0] + a[i];
+    }
+
+}
+
+// Calculate the coefficients of response r of segment seg in the variable t
+// of the interval x = x0 + h * t
+// **************************************************************
+void SegmentInCell(const PiecewisePoly& pp, const size_t seg, const size_t r, const double x0, const double h,
+    double* q) {
+
+    double center = 0.5 * (pp.breaks[seg] + pp.breaks[seg + 1]);
+    double halfwidth = 0.5 * (pp.breaks[seg + 1] - pp.breaks[seg]);
+    ComposeAffine(&pp.coefs[(seg * pp.m + r) * (pp.k + 1)], pp.k, (x0 - center) / halfwidth, h / halfwidth, q);
+
+}
+
+// Build the lookup table of the piecewise polynomial with ncell cells and
+// return its max absolute error
+// The value and slope at the nodes are exact, so the table is C1. The error
+// of every cell is the polynomial p - H on each segment crossing the cell,
+// whose maximum is found exactly at its ends and at the roots of its
+// derivative (PolyRealRoots).
+// **************************************************************
+double BuildLookupTable(const PiecewisePoly& pp, const size_t ncell, LookupTable& lut) {
+
+    size_t kp = max(pp.k, (size_t)3);
+
+    lut.m = pp.m;
+    lut.ncell = ncell;
+    lut.xmin = pp.breaks.front();
+    lut.xmax = pp.breaks.back();
+    lut.invh = ncell / (lut.xmax - lut.xmin);
+    lut.coefs.assign(ncell * pp.m * 4, 0.);
+    double h = (lut.xmax - lut.xmin) / ncell;
+
+    // Value and slope (per unit of t) at the nodes
+    std::vector<double> f((ncell + 1) * pp.m), df((ncell + 1) * pp.m);
+    ParallelFor(ncell + 1, [&](size_t i) {
+        std::vector<double> q(pp.k + 1);
+        double x0 = (i == ncell) ? lut.xmax : lut.xmin + i * h;
+        size_t seg = FindSegment(pp, x0);
+        for (size_t r = 0; r < pp.m; r++) {
+            SegmentInCell(pp, seg, r, x0, h, q.data());
+            f[i * pp.m + r] = q[0];
+            df[i * pp.m + r] = (pp.k > 0) ? q[1] : 0.;
+        }
+    });
+
+    std::vector<double> cellerr(ncell, 0.);
+    ParallelFor(ncell, [&](size_t i) {
+        std::vector<double> q(kp + 1);
+        std::vector<std::vector<double> > derivs;
+        std::vector<double> roots[3];
+        double xa = lut.xmin + i * h;
+        double xb = (i + 1 == ncell) ? lut.xmax : xa + h;
+        size_t s0 = FindSegment(pp, xa);
+        size_t s1 = FindSegment(pp, xb);
+
+        for (size_t r = 0; r < pp.m; r++) {
+            double* c = &lut.coefs[(i * pp.m + r) * 4];
+            double f0 = f[i * pp.m + r], f1 = f[(i + 1) * pp.m + r];
+            double d0 = df[i * pp.m + r], d1 = df[(i + 1) * pp.m + r];
+            c[0] = f0;
+            c[1] = d0;
+            c[2] = 3. * (f1 - f0) - 2. * d0 - d1;
+            c[3] = 2. * (f0 - f1) + d0 + d1;
+
+            for (size_t s = s0; s <= s1; s++) {
+                double ta = (s == s0) ? 0. : (pp.breaks[s] - xa) / h;
+                double tb = (s == s1) ? 1. : (pp.breaks[s + 1] - xa) / h;
+                if (tb <= ta) continue;
+                std::fill(q.begin(), q.end(), 0.);
+                SegmentInCell(pp, s, r, xa, h, q.data());
+                for (size_t j = 0; j < 4; j++) q[j] -= c[j];
+
+                DifferentiatePoly(q.data(), kp, derivs);
+                PolyRealRoots(derivs, 0., ta, tb, roots);
+                double err = max(fabs(HornerPoly(ta, q.data(), kp)), fabs(HornerPoly(tb, q.data(), kp)));
+                for (size_t j = 0; j < roots[1].size(); j++) {
+                    err = max(err, fabs(HornerPoly(roots[1][j], q.data(), kp)));
+                }
+                cellerr[i] = max(cellerr[i], err);
+            }
+        }
+    });
+
+    lut.maxerr = *std::max_element(cellerr.begin(), cellerr.end());
+    return lut.maxerr;
+
+}
+
+// Build the smallest lookup table of the piecewise polynomial with a max
+// absolute error below tolerance: the number of cells is doubled until the
+// tolerance is met, then bisected. Returns false if maxcell is reached or
+// if a jump of the fit at a breakpoint is larger than twice the tolerance,
+// since no continuous table can then meet it.
+// **************************************************************
+bool CompileLookupTable(const PiecewisePoly& pp, const double tolerance, const size_t maxcell, LookupTable& lut) {
+
+    std::vector<double> q(pp.k + 1);
+    lut.maxerr = 0.;
+    for (size_t s = 1; s + 1 < pp.breaks.size(); s++) {
+        for (size_t r = 0; r < pp.m; r++) {
+            SegmentInCell(pp, s - 1, r, pp.breaks[s], 1., q.data());
+            double left = q[0];
+            SegmentInCell(pp, s, r, pp.breaks[s], 1., q.data());
+            lut.maxerr = max(lut.maxerr, 0.5 * fabs(q[0] - left));
+        }
+    }
+    if (lut.maxerr > tolerance) return false;
+
+    size_t hi = 1;
+    while (BuildLookupTable(pp, hi, lut) > tolerance) {
+        if (hi >= maxcell) return false;
+        hi = min(2 * hi, maxcell);
+    }
+
+    size_t lo = hi / 2;
+    LookupTable trial;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (BuildLookupTable(pp, mid, trial) <= tolerance) {
+            hi = mid;
+            lut = trial;
+        }
+        else {
+            lo = mid;
+        }
+    }
+
+    return true;
+
+}
+
+// Write the lookup table to a flat binary file (header and coefficients)
+// **************************************************************
+bool WriteLookupTable(const char* filename, const LookupTable& lut) {
+
+    LookupHeader header;
+    memcpy(header.magic, "PFLUT01", 8);
+    header.m = lut.m;
+    header.ncell = lut.ncell;
+    header.xmin = lut.xmin;
+    header.xmax = lut.xmax;
+    header.invh = lut.invh;
+    header.maxerr = lut.maxerr;
+
+    ofstream output(filename, ios::binary);
+    if (!output) return false;
+    output.write((const char*)&header, sizeof(header));
+    output.write((const char*)lut.coefs.data(), lut.coefs.size() * sizeof(double));
+    return (bool)output;
+
+}
+
+// Read a lookup table written by WriteLookupTable
+// **************************************************************
+bool ReadLookupTable(const char* filename, LookupTable& lut) {
+
+    LookupHeader header;
+    ifstream input(filename, ios::binary);
+    if (!input.read((char*)&header, sizeof(header)) || memcmp(header.magic, "PFLUT01", 8) != 0) return false;
+
+    lut.m = header.m;
+    lut.ncell = header.ncell;
+    lut.xmin = header.xmin;
+    lut.xmax = header.xmax;
+    lut.invh = header.invh;
+    lut.maxerr = header.maxerr;
+    lut.coefs.resize(lut.ncell * lut.m * 4);
+    return (bool)input.read((char*)lut.coefs.data(), lut.coefs.size() * sizeof(double));
+
+}
+
+// Compile the piecewise polynomial into Lookup.bin and compare the speed of
+// the table with the polynomial
+// **************************************************************
+void WriteLookup(const PiecewisePoly& pp, const double tolerance) {
+
+    LookupTable lut, check;
+    const size_t maxcell = (size_t)1 << 20;
+
+    auto t0 = std::chrono::steady_clock::now();
+    bool ok = CompileLookupTable(pp, tolerance, maxcell, lut);
+    auto t1 = std::chrono::steady_clock::now();
+
+    if (!ok) {
+        cout << "The tolerance " << tolerance << " cannot be met with up to " << maxcell << " cells (max error ";
+        cout << lut.maxerr << "); use --continuity 0 or higher for piecewise fits" << endl;
+        return;
+    }
+    if (!WriteLookupTable("Lookup.bin", lut) || !ReadLookupTable("Lookup.bin", check)) {
+        cout << "Error writing Lookup.bin" << endl;
+        return;
+    }
+
+    // Timing on the reloaded table
+    const size_t neval = 1 << 22;
+    double dx = (check.xmax - check.xmin) / neval;
+    double sum = 0.;
+    auto t2 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < neval; i++) sum += EvaluateLookup(check, 0, check.xmin + i * dx);
+    auto t3 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < neval; i++) sum -= EvaluatePiecewise(pp, 0, check.xmin + i * dx);
+    auto t4 = std::chrono::steady_clock::now();
+
+    cout << "Lookup table: " << check.ncell << " cells, " << check.m << " response(s), ";
+    cout << sizeof(LookupHeader) + check.coefs.size() * sizeof(double) << " bytes" << endl;
+    cout << "Max absolute error: " << check.maxerr << " (tolerance " << tolerance << ")" << endl;
+    cout << "Compiled in " << std::chrono::duration<double>(t1 - t0).count() * 1000. << " ms" << endl;
+    cout << "Evaluation: " << std::chrono::duration<double>(t3 - t2).count() * 1.e9 / neval << " ns (table), ";
+    cout << std::chrono::duration<double>(t4 - t3).count() * 1.e9 / neval << " ns (polynomial)";
+    cout << (sum == sum ? "" : " ") << endl;
+    cout << "Table written to Lookup.bin" << endl;
+
+}
+
+// Result of a fit served by the fit server
+// **************************************************************
+struct FitResult {
+    size_t n = 0;                                    // Number of points
+    size_t k = 0;                                    // Polynomial order
+    std::vector<double> beta;                        // Coefficients [k+1]
+    std::vector<double> serbeta;                     // Standard error on coefficients [k+1]
+    std::vector<double> cov;                         // Covariance matrix [k+1][k+1]
+    double RSS = 0.;
+    double TSS = 0.;
+    double R2 = 0.;
+    double R2Adj = 0.;
+    double SE = 0.;                                  // Standard error
+    double tstudentval = 0.;                         // Student t value
+    std::string message;                             // Why the fit failed, or a warning
+};
+
+// Sufficient statistics of a weighted fit of y against x up to order K,
+// in the scaled variable x' = (x - center) / scale and the centered
+// response y' = y - ycenter
+// The sums of y' keep the RSS, obtained by difference, from cancelling out
+// when y has a large offset.
+// **************************************************************
+struct SufficientStats {
+    size_t order = 0;                                // Highest order that can be fitted (K)
+    double n = 0.;                                   // Number of points
+    double center = 0.;                              // Scaling of x
+    double scale = 1.;
+    double xmin = 0.;                                // Range of x
+    double xmax = 0.;
+    double ycenter = 0.;                             // Centering of y
+    std::vector<double> S;                           // Sum of w x'^j [2K+1]
+    std::vector<double> Sy;                          // Sum of w x'^j y' [K+1]
+    double Syy = 0.;                                 // Sum of w y'^2
+};
+
+// Add the points to the sufficient statistics, in their scaling
+// **************************************************************
+void AccumulateSufficientStats(SufficientStats& stats, const double* x, const double* y, const double* w,
+    const size_t n) {
+
+    if (n == 0) return;
+    if (stats.n == 0.) {
+        stats.xmin = x[0];
+        stats.xmax = x[0];
+    }
+    stats.n += (double)n;
+    stats.xmin = min(stats.xmin, *std::min_element(x, x + n));
+    stats.xmax = max(stats.xmax, *std::max_element(x, x + n));
+
+    double* xs = new double[n];
+    double* ys = new double[n];
+    double** XTWY = Make2DArray(1, stats.order + 1);
+    double* Y[1] = { ys };
+    for (size_t i = 0; i < n; i++) {
+        xs[i] = (x[i] - stats.center) / stats.scale;
+        ys[i] = y[i] - stats.ycenter;
+        stats.Syy += w[i] * ys[i] * ys[i];
+    }
+    AccumulatePowerSums(xs, Y, w, n, 1, stats.order, stats.S.data(), XTWY);
+    for (size_t j = 0; j <= stats.order; j++) stats.Sy[j] += XTWY[0][j];
+
+    delete[] xs;
+    delete[] ys;
+    Free2DArray(XTWY, 1);
+
+}
+
+// Calculate the sufficient statistics of the points, scaled by the range
+// of x and centered on the weighted mean of y
+// **************************************************************
+void BuildSufficientStats(const double* x, const double* y, const double* w, const size_t n, const size_t order,
+    SufficientStats& stats) {
+
+    double xmin = *std::min_element(x, x + n);
+    double xmax = *std::max_element(x, x + n);
+    double sumw = 0., sumwy = 0., sumy = 0.;
+    for (size_t i = 0; i < n; i++) {
+        sumw += w[i];
+        sumwy += w[i] * y[i];
+        sumy += y[i];
+    }
+
+    stats = SufficientStats();
+    stats.order = order;
+    stats.center = 0.5 * (xmin + xmax);
+    stats.scale = (xmax > xmin) ? 0.5 * (xmax - xmin) : 1.;
+    stats.ycenter = (sumw > 0.) ? sumwy / sumw : sumy / n;
+    stats.S.assign(2 * order + 1, 0.);
+    stats.Sy.assign(order + 1, 0.);
+    AccumulateSufficientStats(stats, x, y, w, n);
+
+}
+
+// Express the sufficient statistics in another scaling of x
+// The new variable is alpha + beta x' in the old one, so the sums of its
+// powers are binomial combinations of the old sums.
+// **************************************************************
+void RescaleSufficientStats(SufficientStats& stats, const double center, const double scale) {
+
+    double alpha = (stats.center - center) / scale;
+    double beta = stats.scale / scale;
+    size_t K = stats.order;
+
+    std::vector<double> c(2 * K + 1, 0.);            // Coefficients of (alpha + beta x')^j
+    std::vector<double> S(2 * K + 1, 0.), Sy(K + 1, 0.);
+    c[0] = 1.;
+    for (size_t j = 0; j <= 2 * K; j++) {
+        if (j > 0) {
+            for (size_t i = j; i > 0; i--) {
+                c[i] = alpha * c[i] + beta * c[i - 1];
+            }
+            c[0] *= alpha;
+        }
+        for (size_t i = 0; i <= j; i++) {
+            S[j] += c[i] * stats.S[i];
+            if (j <= K) Sy[j] += c[i] * stats.Sy[i];
+        }
+    }
+
+    stats.S = S;
+    stats.Sy = Sy;
+    stats.center = center;
+    stats.scale = scale;
+
+}
+
+// Center the sums of the sufficient statistics on another value of y
+// With y'' = y' + d, the sums of y'' follow from those of y' and S.
+// **************************************************************
+void ShiftSufficientStats(SufficientStats& stats, const double ycenter) {
+
+    double d = stats.ycenter - ycenter;
+    stats.Syy += 2. * d * stats.Sy[0] + d * d * stats.S[0];
+    for (size_t j = 0; j <= stats.order; j++) stats.Sy[j] += d * stats.S[j];
+    stats.ycenter = ycenter;
+
+}
+
+// Merge the sufficient statistics b in a, scaled on the union of the ranges
+// and centered on the weighted mean of y of the union
+// The order of the result is the lowest of the two.
+// **************************************************************
+void MergeSufficientStats(SufficientStats& a, SufficientStats b) {
+
+    size_t order = min(a.order, b.order);
+    a.order = b.order = order;
+    a.S.resize(2 * order + 1);
+    b.S.resize(2 * order + 1);
+    a.Sy.resize(order + 1);
+    b.Sy.resize(order + 1);
+
+    double xmin = min(a.xmin, b.xmin);
+    double xmax = max(a.xmax, b.xmax);
+    double center = 0.5 * (xmin + xmax);
+    double scale = (xmax > xmin) ? 0.5 * (xmax - xmin) : 1.;
+    RescaleSufficientStats(a, center, scale);
+    RescaleSufficientStats(b, center, scale);
+
+    double sumw = a.S[0] + b.S[0];
+    double ycenter = (sumw > 0.) ? (a.S[0] * a.ycenter + a.Sy[0] + b.S[0] * b.ycenter + b.Sy[0]) / sumw : a.ycenter;
+    ShiftSufficientStats(a, ycenter);
+    ShiftSufficientStats(b, ycenter);
+
+    a.n += b.n;
+    a.xmin = xmin;
+    a.xmax = xmax;
+    for (size_t j = 0; j <= 2 * order; j++) a.S[j] += b.S[j];
+    for (size_t j = 0; j <= order; j++) a.Sy[j] += b.Sy[j];
+    a.Syy += b.Syy;
+
+}
+
+// Write the sufficient statistics to a text file with full precision
+// **************************************************************
+bool WriteSufficientStats(const std::string& filename, const SufficientStats& stats) {
+
+    ofstream output(filename.c_str());
+    if (!output) return false;
+
+    output << std::setprecision(17);
+    output << "polyfit-summary 2" << endl;
+    output << "order " << stats.order << endl;
+    output << "n " << stats.n << endl;
+    output << "scaling " << stats.center << " " << stats.scale << endl;
+    output << "range " << stats.xmin << " " << stats.xmax << endl;
+    output << "ycenter " << stats.ycenter << endl;
+    output << "Syy " << stats.Syy << endl;
+    output << "S";
+    for (size_t j = 0; j < stats.S.size(); j++) output << " " << stats.S[j];
+    output << endl << "Sy";
+    for (size_t j = 0; j < stats.Sy.size(); j++) output << " " << stats.Sy[j];
+    output << endl;
+
+    return (bool)output;
+
+}
+
+// Read the sufficient statistics written by WriteSufficientStats
+// The summaries of version 1 have uncentered sums of y (ycenter 0).
+// **************************************************************
+bool ReadSufficientStats(const std::string& filename, SufficientStats& stats) {
+
+    ifstream input(filename.c_str());
+    std::string key;
+    int version = 0;
+    if (!(input >> key >> version) || key != "polyfit-summary" || version < 1 || version > 2) return false;
+
+    input >> key >> stats.order;
+    input >> key >> stats.n;
+    input >> key >> stats.center >> stats.scale;
+    input >> key >> stats.xmin >> stats.xmax;
+    stats.ycenter = 0.;
+    if (version >= 2) input >> key >> stats.ycenter;
+    input >> key >> stats.Syy;
+    stats.S.resize(2 * stats.order + 1);
+    stats.Sy.resize(stats.order + 1);
+    input >> key;
+    for (size_t j = 0; j < stats.S.size(); j++) input >> stats.S[j];
+    input >> key;
+    for (size_t j = 0; j < stats.Sy.size(); j++) input >> stats.Sy[j];
+
+    return (bool)input;
+
+}
+
+// Merge summary files into one
+// **************************************************************
+int MergeSummaryFiles(const char* outfile, const char* const* infiles, const size_t count) {
+
+    SufficientStats total, stats;
+    for (size_t i = 0; i < count; i++) {
+        if (!ReadSufficientStats(infiles[i], stats)) {
+            cout << "Error reading summary " << infiles[i] << endl;
+            return 1;
+        }
+        if (i == 0) total = stats;
+        else MergeSufficientStats(total, stats);
+    }
+    if (!WriteSufficientStats(outfile, total)) {
+        cout << "Error writing summary " << outfile << endl;
+        return 1;
+    }
+
+    cout << "Merged " << count << " summaries (" << total.n << " points, order " << total.order << ") in ";
+    cout << outfile << endl;
+    return 0;
+
+}
+
+// Transform the coefficients of a polynomial of the scaled variable
+// (x - center) / scale, and the matrix inverse of their XTWX, to x
+// The coefficients in x are T scaled, where column j of T holds the
+// coefficients of ((x - center) / scale)^j, and the inverse is T inverse T'.
+// **************************************************************
+void ScaledToRaw(const double* scaled, double** inverse, const size_t k, const double center, const double scale,
+    double* beta, double** rawinverse) {
+
+    double** T = Make2DArray(k + 1, k + 1);
+    std::vector<double> unit(k + 1, 0.), column(k + 1);
+    for (size_t j = 0; j < k + 1; j++) {
+        unit[j] = 1.;
+        ComposeAffine(unit.data(), j, -center / scale, 1. / scale, column.data());
+        for (size_t i = 0; i <= j; i++) T[i][j] = column[i];
+        unit[j] = 0.;
+    }
+
+    for (size_t i = 0; i < k + 1; i++) {
+        beta[i] = 0.;
+        for (size_t l = 0; l < k + 1; l++) rawinverse[i][l] = 0.;
+        for (size_t j = 0; j < k + 1; j++) {
+            beta[i] += T[i][j] * scaled[j];
+            for (size_t l = 0; l < k + 1; l++) {
+                for (size_t m = 0; m < k + 1; m++) {
+                    rawinverse[i][l] += T[i][j] * inverse[j][m] * T[l][m];
+                }
+            }
+        }
+    }
+
+    Free2DArray(T, k + 1);
+
+}
+
+// Fit a polynomial of order k from the sufficient statistics
+// The fit of the centered y is solved in the scaled variable (centered on 0
+// if the intercept is fixed) and the coefficients and their covariance are
+// transformed back to x by ScaledToRaw. Nothing is displayed: the reason of
+// a failure, or a warning, is returned in result.message.
+// **************************************************************
+bool SolveSufficientStats(SufficientStats stats, const size_t k, const bool fixedinter, const double fixedinterval,
+    const double alphaval, FitResult& result) {
+
+    if (k > stats.order) {
+        result.message = "The summary only holds the power sums up to order " + std::to_string(stats.order);
+        return false;
+    }
+    if (fixedinter) RescaleSufficientStats(stats, 0., stats.scale);
+
+    size_t n = (size_t)llround(stats.n);
+    size_t nstar = n - 1;
+    if (fixedinter) nstar = n;
+    if (n == 0 || k >= nstar) {
+        result.message = "The polynomial order is too high";
+        return false;
+    }
+
+    double** XTWXInv = Make2DArray(k + 1, k + 1);
+    double** CovInv = Make2DArray(k + 1, k + 1);
+    double** XTWY = Make2DArray(1, k + 1);
+    double* scaled = new double[k + 1];
+    double* beta[1] = { scaled };
+
+    std::copy(stats.Sy.begin(), stats.Sy.begin() + k + 1, XTWY[0]);
+    if (!SolvePowerSums(stats.S.data(), XTWY, 1, k, fixedinter, fixedinterval - stats.ycenter, beta, XTWXInv)) {
+        result.message = "Matrix XTWX is not positive definite, using the cofactor inverse";
+    }
+
+    // RSS = Syy - 2 beta.Sy + beta.XTWX.beta, in the centered y
+    double RSS = stats.Syy;
+    for (size_t j = 0; j < k + 1; j++) {
+        RSS -= 2. * scaled[j] * stats.Sy[j];
+        for (size_t l = 0; l < k + 1; l++) {
+            RSS += scaled[j] * stats.S[j + l] * scaled[l];
+        }
+    }
+    result.n = n;
+    result.k = k;
+    if (RSS < 1e-12 * stats.Syy) {
+        if (!result.message.empty()) result.message += "\n";
+        result.message += "The RSS is below the precision of the sums of y";
+    }
+    result.RSS = max(RSS, 0.);
+    result.TSS = fixedinter ? stats.Syy + 2. * stats.ycenter * stats.Sy[0] + stats.ycenter * stats.ycenter * stats.S[0]
+        : stats.Syy - stats.Sy[0] * stats.Sy[0] / stats.S[0];
+    result.R2 = 1. - result.RSS / result.TSS;
+    double dferr = (double)n - (k + 1) + (fixedinter ? 1. : 0.);
+    double dftot = (double)n - 1 + (fixedinter ? 1. : 0.);
+    result.R2Adj = 1. - dftot / dferr * result.RSS / result.TSS;
+    result.SE = sqrt(result.RSS / (nstar - k));
+    result.tstudentval = fabs(CalculateTValueStudent(nstar - k, 1. - 0.5 * alphaval));
+
+    result.beta.resize(k + 1);
+    ScaledToRaw(scaled, XTWXInv, k, stats.center, stats.scale, result.beta.data(), CovInv);
+    result.beta[0] += stats.ycenter;
+    if (fixedinter) result.beta[0] = fixedinterval;
+    result.serbeta.resize(k + 1);
+    CalculateSERRBeta(fixedinter, result.SE, k, result.serbeta.data(), CovInv);
+
+    result.cov.resize((k + 1) * (k + 1));
+    for (size_t i = 0; i < k + 1; i++) {
+        for (size_t j = 0; j < k + 1; j++) {
+            result.cov[i * (k + 1) + j] = result.SE * result.SE * CovInv[i][j];
+        }
+    }
+    if (fixedinter) result.cov[0] = 1.;
+
+    Free2DArray(XTWXInv, k + 1);
+    Free2DArray(CovInv, k + 1);
+    Free2DArray(XTWY, 1);
+    delete[] scaled;
+
+    return true;
+
+}
+
+// Fit a polynomial of order k from the sufficient statistics and display
+// the results as the csv fit does
+// **************************************************************
+bool FitSufficientStats(const SufficientStats& stats, const size_t k, const bool fixedinter,
+    const double fixedinterval, const double alphaval) {
+
+    FitResult result;
+    bool solved = SolveSufficientStats(stats, k, fixedinter, fixedinterval, alphaval, result);
+    if (!result.message.empty()) cout << result.message << (solved ? "" : ". Program stopped") << endl;
+    if (!solved) return false;
+
+    size_t nstar = result.n - 1;
+    if (fixedinter) nstar = result.n;
+
+    double** Cov = Make2DArray(k + 1, k + 1);
+    for (size_t i = 0; i < k + 1; i++) {
+        for (size_t j = 0; j < k + 1; j++) {
+            Cov[i][j] = result.cov[i * (k + 1) + j];
+        }
+    }
+
+    cout << "Number of points: " << result.n << endl;
+    cout << "Polynomial order: " << k << endl;
+    cout << "t-student value: " << result.tstudentval << endl << endl;
+    DisplayPolynomial(k);
+    DisplayCoefs(k, nstar, result.tstudentval, result.beta.data(), result.serbeta.data());
+    DisplayStatistics(result.n, nstar, k, result.RSS, result.R2, result.R2Adj, result.SE);
+    DisplayANOVA(nstar, k, result.TSS, result.RSS);
+    DisplayCovCorrMatrix(k, 1., fixedinter, Cov);
+
+    Free2DArray(Cov, k + 1);
+
+    return true;
+
+}
+
+// Highest order fitted by the fit server
+// **************************************************************
+#define SERVERORDER 20
+
+// Dataset kept in memory by the fit server: the sufficient statistics of
+// its responses (y, R_c, V_target) for the unit weights, in x scaled on its
+// range, up to SERVERORDER. The points themselves are not kept. The rows
+// where a response is not finite (inf in R_c) are left out of its statistics.
+// **************************************************************
+struct ServerDataset {
+    time_t mtime = 0;                                // Modification time of the file
+    off_t size = 0;                                  // Size of the file
+    size_t n = 0;                                    // Number of rows
+    SufficientStats stats[3];                        // Statistics of y, R_c and V_target
+    size_t dropped[3] = { 0, 0, 0 };                 // Non-finite values of each response
+    uint64_t used = 0;                               // Last use, for the eviction
+};
+
+// Connection of a client of the fit server
+// **************************************************************
+struct ServerClient {
+    int fd = -1;
+    std::string buffer;                              // Incomplete request line
+    std::chrono::steady_clock::time_point queued;    // Time it was queued for a worker
+};
+
+// State shared by the threads of the fit server
+// **************************************************************
+struct FitServer {
+    std::mutex lock;                                 // Protects the queue, the connections and the caches
+    std::condition_variable ready;
+    std::deque<std::shared_ptr<ServerClient> > queue;   // Connections with requests, waiting for a worker
+    std::vector<std::shared_ptr<ServerClient> > idle;   // Connections handed back by the workers
+    std::set<int> active;                            // Connections being served
+    int wakefd[2] = { -1, -1 };                      // Pipe waking the accepting thread
+    size_t capacity = 64;                            // Max number of queued connections
+    std::map<std::string, std::shared_ptr<ServerDataset> > datasets;
+    size_t maxdatasets = 16;                         // Max number of cached datasets
+    uint64_t clock = 0;                              // Counter of the dataset uses
+    std::map<std::pair<double, double>, double> tcache;    // Student t values by (nu, alpha)
+    std::atomic<bool> stop{ false };
+    std::atomic<size_t> served{ 0 };
+    std::atomic<size_t> rejected{ 0 };
+};
+
+// Calculate the Student t value, cached across requests
+// **************************************************************
+double ServerTValue(FitServer& server, const double nu, const double alpha) {
+
+    std::pair<double, double> key(nu, alpha);
+    {
+        std::lock_guard<std::mutex> guard(server.lock);
+        auto it = server.tcache.find(key);
+        if (it != server.tcache.end()) return it->second;
+    }
+    double t = fabs(CalculateTValueStudent(nu, 1. - 0.5 * alpha));
+    std::lock_guard<std::mutex> guard(server.lock);
+    server.tcache[key] = t;
+    return t;
+
+}
+
+// Find the dataset of a file, reading it again if it changed on disk
+// The datasets are cached by file name; beyond maxdatasets the least
+// recently used one is evicted (the requests still using it keep it alive).
+// **************************************************************
+std::shared_ptr<ServerDataset> ServerLoadDataset(FitServer& server, const std::string& filename, bool& hit) {
+
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) return std::shared_ptr<ServerDataset>();
+
+    {
+        std::lock_guard<std::mutex> guard(server.lock);
+        auto it = server.datasets.find(filename);
+        if (it != server.datasets.end() && it->second->mtime == st.st_mtime && it->second->size == st.st_size) {
+            it->second->used = ++server.clock;
+            hit = true;
+            return it->second;
+        }
+    }
+
+    hit = false;
+    std::vector<double> x, y, rc, v;
+    if (!ReadCSV(filename, x, y, rc, v) || x.empty()) {
+        return std::shared_ptr<ServerDataset>();
+    }
+    std::shared_ptr<ServerDataset> data = std::make_shared<ServerDataset>();
+    data->mtime = st.st_mtime;
+    data->size = st.st_size;
+    data->n = x.size();
+    const std::vector<double>* Y[3] = { &y, &rc, &v };
+    for (size_t r = 0; r < 3; r++) {
+        std::vector<double> xf, yf;
+        for (size_t i = 0; i < x.size(); i++) {
+            if (!std::isfinite((*Y[r])[i])) continue;
+            xf.push_back(x[i]);
+            yf.push_back((*Y[r])[i]);
+        }
+        data->dropped[r] = x.size() - xf.size();
+        if (xf.empty()) continue;
+        std::vector<double> w(xf.size(), 1.);
+        BuildSufficientStats(xf.data(), yf.data(), w.data(), xf.size(), SERVERORDER, data->stats[r]);
+    }
+
+    std::lock_guard<std::mutex> guard(server.lock);
+    data->used = ++server.clock;
+    server.datasets[filename] = data;
+    while (server.datasets.size() > server.maxdatasets) {
+        auto oldest = server.datasets.begin();
+        for (auto it = server.datasets.begin(); it != server.datasets.end(); ++it) {
+            if (it->second->used < oldest->second->used) oldest = it;
+        }
+        server.datasets.erase(oldest);
+    }
+    return data;
+
+}
+
+// Append the values to a response line
+// **************************************************************
+void ServerAppend(std::ostringstream& out, const char* key, const double* values, const size_t count) {
+
+    out << " " << key << "=";
+    for (size_t i = 0; i < count; i++) {
+        out << (i ? "," : "") << values[i];
+    }
+
+}
+
+// Process one request line and return the response line
+// Requests: "fit file=<csv> | data=x,y[,sigma];..." with the options
+// response=y|R_c|V_target, degree=k, fixed=a0, weights=0|1|2, alpha=a;
+// "stats"; "shutdown".
+// **************************************************************
+std::string ServerRequest(FitServer& server, const std::string& line) {
+
+    std::istringstream ss(line);
+    std::string command, token;
+    ss >> command;
+
+    std::ostringstream out;
+    out << std::setprecision(12);
+
+    if (command == "stats") {
+        std::lock_guard<std::mutex> guard(server.lock);
+        out << "ok datasets=" << server.datasets.size() << " tvalues=" << server.tcache.size();
+        out << " served=" << server.served << " rejected=" << server.rejected << " queued=" << server.queue.size();
+        return out.str();
+    }
+    if (command == "shutdown") {
+        server.stop = true;
+        return "ok shutdown";
+    }
+    if (command != "fit") return "error unknown command";
+
+    std::string filename, data, response = "y";
+    size_t k = 4;
+    bool fixedinter = false;
+    double fixedinterval = 0.;
+    int wtype = 0;
+    double alphaval = 0.05;
+
+    while (ss >> token) {
+        size_t eq = token.find('=');
+        if (eq == std::string::npos) return "error malformed option " + token;
+        std::string key = token.substr(0, eq);
+        std::string value = token.substr(eq + 1);
+        if (key == "file") filename = value;
+        else if (key == "data") data = value;
+        else if (key == "response") response = value;
+        else if (key == "degree") k = strtoul(value.c_str(), NULL, 10);
+        else if (key == "fixed") {
+            fixedinter = true;
+            fixedinterval = atof(value.c_str());
+        }
+        else if (key == "weights") wtype = atoi(value.c_str());
+        else if (key == "alpha") alphaval = atof(value.c_str());
+        else return "error unknown option " + key;
+    }
+
+    if (k < 1 || k > SERVERORDER) return "error degree must be between 1 and " + std::to_string(SERVERORDER);
+    if (wtype < 0 || wtype > 2) return "error weights must be 0, 1 or 2";
+
+    FitResult result;
+    SufficientStats stats;
+    size_t dropped = 0;
+    bool hit = false;
+
+    if (!filename.empty()) {
+
+        // Datasets only hold unit weights
+        if (wtype != 0) return "error weights need sigma values (data=x,y,sigma;...)";
+        int r = (response == "y") ? 0 : (response == "R_c") ? 1 : (response == "V_target") ? 2 : -1;
+        if (r < 0) return "error unknown response " + response;
+        std::shared_ptr<ServerDataset> dataset = ServerLoadDataset(server, filename, hit);
+        if (!dataset) return "error cannot read " + filename;
+        stats = dataset->stats[r];
+        dropped = dataset->dropped[r];
+        if (stats.n == 0.) return "error no finite values of " + response;
+    }
+    else if (!data.empty()) {
+
+        std::vector<double> x, y, erry;
+        std::istringstream points(data);
+        std::string point;
+        while (std::getline(points, point, ';')) {
+            double values[3];
+            int count = sscanf(point.c_str(), "%lf,%lf,%lf", &values[0], &values[1], &values[2]);
+            if (count < 2 || (wtype != 0 && count < 3)) return "error malformed point " + point;
+            x.push_back(values[0]);
+            y.push_back(values[1]);
+            erry.push_back(count == 3 ? values[2] : 0.);
+        }
+        std::vector<double> w(x.size());
+        CalculateWeights(erry.data(), w.data(), x.size(), wtype);
+        if (std::find(w.begin(), w.end(), 0.) != w.end()) return "error one or more points have 0 error";
+        BuildSufficientStats(x.data(), y.data(), w.data(), x.size(), k, stats);
+    }
+    else {
+        return "error fit needs file= or data=";
+    }
+
+    // Solved from the statistics: O(k^3) on a cached dataset. The t value
+    // comes from the cache of the server (alpha 0 skips it in the solve).
+    if (!SolveSufficientStats(stats, k, fixedinter, fixedinterval, 0., result)) {
+        result.message[0] = (char)tolower(result.message[0]);
+        return "error " + result.message;
+    }
+    size_t nstar = fixedinter ? result.n : result.n - 1;
+    result.tstudentval = ServerTValue(server, (double)(nstar - k), alphaval);
+
+    out << "ok n=" << result.n << " k=" << result.k << " cache=" << (hit ? "hit" : "miss");
+    if (dropped > 0) out << " dropped=" << dropped;
+    out << " rss=" << result.RSS << " tss=" << result.TSS << " r2=" << result.R2 << " r2adj=" << result.R2Adj;
+    out << " se=" << result.SE << " t=" << result.tstudentval;
+    ServerAppend(out, "beta", result.beta.data(), k + 1);
+    ServerAppend(out, "serbeta", result.serbeta.data(), k + 1);
+    ServerAppend(out, "cov", result.cov.data(), (k + 1) * (k + 1));
+    return out.str();
+
+}
+
+// Serve the complete request lines waiting on a connection
+// The connection is readable: its bytes are read once (without blocking)
+// and every complete line is answered, the rest being kept for the next
+// time. Each response reports the time spent on the request and the time
+// the connection waited in the queue for a worker. Returns false if the
+// connection was closed by the client or an answer could not be sent.
+// **************************************************************
+bool ServerConnection(FitServer& server, ServerClient& client) {
+
+    char chunk[65536];
+    ssize_t count = read(client.fd, chunk, sizeof(chunk));
+    if (count <= 0) return false;
+    client.buffer.append(chunk, count);
+
+    size_t eol;
+    while ((eol = client.buffer.find('\n')) != std::string::npos) {
+        std::string line = client.buffer.substr(0, eol);
+        client.buffer.erase(0, eol + 1);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+
+        auto t0 = std::chrono::steady_clock::now();
+        std::string response = ServerRequest(server, line);
+        auto t1 = std::chrono::steady_clock::now();
+        server.served++;
+
+        std::ostringstream out;
+        out << response << " latency_us=" << std::chrono::duration<double, std::micro>(t1 - t0).count();
+        out << " queue_us=" << std::chrono::duration<double, std::micro>(t0 - client.queued).count() << "\n";
+
+        std::string reply = out.str();
+        for (size_t sent = 0; sent < reply.size();) {
+            ssize_t written = write(client.fd, reply.data() + sent, reply.size() - sent);
+            if (written <= 0) return false;
+            sent += written;
+        }
+        if (server.stop) return false;
+    }
+    return true;
+
+}
+
+// Wake the accepting thread of the fit server
+// **************************************************************
+void ServerWake(FitServer& server) {
+
+    char byte = 0;
+    if (write(server.wakefd[1], &byte, 1) < 0 && errno != EAGAIN) perror("Error waking the server");
+
+}
+
+// Run the fit server on a Unix domain socket
+// The accepting thread polls the listening socket and the idle connections;
+// a connection with pending requests is queued for a pool of threads, which
+// answer its complete lines and hand it back to the polling. A worker is
+// thus only busy while requests are served, whatever the number of open
+// connections. When the queue is full, the idle connections are no longer
+// polled and the new connections are answered "error busy" and closed.
+// A shutdown request wakes the accepting thread through a pipe; the active
+// connections are shut down and the workers joined. At most maxdatasets csv
+// files are kept in the cache.
+// **************************************************************
+int RunFitServer(const char* path, const size_t nthreads, const size_t capacity, const size_t maxdatasets) {
+
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+        perror("Error creating socket");
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        cout << "Socket path too long: " << path << endl;
+        close(listenfd);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenfd, 128) != 0) {
+        perror("Error binding socket");
+        close(listenfd);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);                        // Clients may close before the response
+
+    FitServer server;
+    server.capacity = capacity;
+    server.maxdatasets = max(maxdatasets, (size_t)1);
+    if (pipe(server.wakefd) != 0) {
+        perror("Error creating pipe");
+        close(listenfd);
+        return 1;
+    }
+    fcntl(server.wakefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(server.wakefd[1], F_SETFL, O_NONBLOCK);
+
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < nthreads; t++) {
+        pool.emplace_back([&server]() {
+            while (true) {
+                std::unique_lock<std::mutex> guard(server.lock);
+                server.ready.wait(guard, [&server]() { return server.stop || !server.queue.empty(); });
+                if (server.stop) return;
+                std::shared_ptr<ServerClient> client = server.queue.front();
+                server.queue.pop_front();
+                server.active.insert(client->fd);
+                guard.unlock();
+
+                bool open = ServerConnection(server, *client);
+
+                guard.lock();
+                server.active.erase(client->fd);
+                if (open && !server.stop) {
+                    server.idle.push_back(client);
+                }
+                else {
+                    close(client->fd);
+                }
+                guard.unlock();
+                ServerWake(server);
+            }
+        });
+    }
+
+    cout << "Serving on " << path << " with " << nthreads << " threads (queue " << capacity;
+    cout << ", cache " << server.maxdatasets << " datasets)" << endl;
+
+    std::vector<std::shared_ptr<ServerClient> > clients;     // Idle connections, polled
+    std::vector<struct pollfd> pfds;
+    while (!server.stop) {
+        bool full;
+        {
+            std::lock_guard<std::mutex> guard(server.lock);
+            clients.insert(clients.end(), server.idle.begin(), server.idle.end());
+            server.idle.clear();
+            full = server.queue.size() >= server.capacity;
+        }
+
+        pfds.assign(2, pollfd());
+        pfds[0] = { listenfd, POLLIN, 0 };
+        pfds[1] = { server.wakefd[0], POLLIN, 0 };
+        if (!full) {
+            for (size_t c = 0; c < clients.size(); c++) pfds.push_back({ clients[c]->fd, POLLIN, 0 });
+        }
+        if (poll(pfds.data(), pfds.size(), 200) <= 0) continue;
+
+        if (pfds[1].revents) {
+            char drain[256];
+            while (read(server.wakefd[0], drain, sizeof(drain)) > 0) {}
+        }
+
+        // Connections with pending requests go to the workers
+        size_t queued = 0;
+        for (size_t c = pfds.size() - 2; c-- > 0;) {
+            if (!pfds[c + 2].revents) continue;
+            clients[c]->queued = std::chrono::steady_clock::now();
+            std::lock_guard<std::mutex> guard(server.lock);
+            server.queue.push_back(clients[c]);
+            clients.erase(clients.begin() + c);
+            queued++;
+        }
+        if (queued == 1) server.ready.notify_one();
+        else if (queued > 1) server.ready.notify_all();
+
+        if (pfds[0].revents) {
+            int fd = accept(listenfd, NULL, NULL);
+            if (fd < 0) continue;
+            if (full) {
+                server.rejected++;
+                const char busy[] = "error busy\n";
+                if (write(fd, busy, sizeof(busy) - 1) < 0) perror("Error answering busy");
+                close(fd);
+                continue;
+            }
+            std::shared_ptr<ServerClient> client = std::make_shared<ServerClient>();
+            client->fd = fd;
+            clients.push_back(client);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(server.lock);
+        for (auto it = server.active.begin(); it != server.active.end(); ++it) shutdown(*it, SHUT_RDWR);
+    }
+    server.ready.notify_all();
+    for (size_t t = 0; t < pool.size(); t++) pool[t].join();
+    for (size_t c = 0; c < clients.size(); c++) close(clients[c]->fd);
+    for (size_t c = 0; c < server.idle.size(); c++) close(server.idle[c]->fd);
+    for (size_t c = 0; c < server.queue.size(); c++) close(server.queue[c]->fd);
+    close(server.wakefd[0]);
+    close(server.wakefd[1]);
+    close(listenfd);
+    unlink(path);
+
+    cout << "Served " << server.served << " requests, rejected " << server.rejected << " connections" << endl;
+    return 0;
+
+}
+
+// Columns x and y stored in single precision after centering and scaling:
+// x = xcenter + xscale * xf, y = ycenter + yscale * yf
+// **************************************************************
+struct FloatColumns {
+    size_t n = 0;
+    double xcenter = 0.;
+    double xscale = 1.;
+    double ycenter = 0.;
+    double yscale = 1.;
+    std::vector<float> x;
+    std::vector<float> y;
+};
+
+// Store x and y as centered and scaled floats, with the scaling of x on its
+// range and of y on its mean and largest deviation
+// **************************************************************
+void PackFloatColumns(const double* x, const double* y, const size_t n, FloatColumns& cols) {
+
+    double xmin = *std::min_element(x, x + n);
+    double xmax = *std::max_element(x, x + n);
+    double ymean = 0.;
+    for (size_t i = 0; i < n; i++) ymean += y[i];
+    ymean /= n;
+    double ydev = 0.;
+    for (size_t i = 0; i < n; i++) ydev = max(ydev, fabs(y[i] - ymean));
+
+    cols.n = n;
+    cols.xcenter = 0.5 * (xmin + xmax);
+    cols.xscale = (xmax > xmin) ? 0.5 * (xmax - xmin) : 1.;
+    cols.ycenter = ymean;
+    cols.yscale = (ydev > 0.) ? ydev : 1.;
+    cols.x.resize(n);
+    cols.y.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        cols.x[i] = (float)((x[i] - cols.xcenter) / cols.xscale);
+        cols.y[i] = (float)((y[i] - cols.ycenter) / cols.yscale);
+    }
+
+}
+
+// Add b to the sum s, keeping the rounding error in c (TwoSum)
+// **************************************************************
+inline void CompensatedAdd(double& s, double& c, const double b) {
+
+    double t = s + b;
+    double bb = t - s;
+    c += (s - (t - bb)) + (b - bb);
+    s = t;
+
+}
+
+// Accumulate the power sums of the float columns in double
+// The rows are processed by blocks of FLOATLANES, widened to double, with
+// one partial sum per lane so the loops over the lanes vectorize. The last
+// block is padded with zero weights. With COMPENSATED, every partial sum
+// carries its rounding error (double-double accumulation).
+// **************************************************************
+#define FLOATLANES 8
+
+template <bool COMPENSATED>
+void AccumulateFloatLanes(const FloatColumns& cols, const double* w, const size_t k, double* S, double* Sy,
+    double& Syy) {
+
+    const size_t L = FLOATLANES;
+    std::vector<double> acc((3 * k + 3) * L, 0.);    // Lanes of S [2k+1], Sy [k+1] and Syy
+    std::vector<double> comp((3 * k + 3) * L, 0.);
+    double* accS = acc.data();
+    double* accY = accS + (2 * k + 1) * L;
+    double* accYY = accY + (k + 1) * L;
+    double* compS = comp.data();
+    double* compY = compS + (2 * k + 1) * L;
+    double* compYY = compY + (k + 1) * L;
+
+    for (size_t i0 = 0; i0 < cols.n; i0 += L) {
+        double xv[L], yv[L], p[L];
+        size_t count = min(L, cols.n - i0);
+        for (size_t l = 0; l < L; l++) {
+            bool valid = l < count;
+            xv[l] = valid ? (double)cols.x[i0 + l] : 0.;
+            yv[l] = valid ? (double)cols.y[i0 + l] : 0.;
+            p[l] = valid ? (w ? w[i0 + l] : 1.) : 0.;
+        }
+        for (size_t l = 0; l < L; l++) {
+            if (COMPENSATED) CompensatedAdd(accYY[l], compYY[l], p[l] * yv[l] * yv[l]);
+            else accYY[l] += p[l] * yv[l] * yv[l];
+        }
+        for (size_t j = 0; j < 2 * k + 1; j++) {
+            double* s = accS + j * L;
+            double* c = compS + j * L;
+            for (size_t l = 0; l < L; l++) {
+                if (COMPENSATED) CompensatedAdd(s[l], c[l], p[l]);
+                else s[l] += p[l];
+            }
+            if (j < k + 1) {
+                double* sy = accY + j * L;
+                double* cy = compY + j * L;
+                for (size_t l = 0; l < L; l++) {
+                    if (COMPENSATED) CompensatedAdd(sy[l], cy[l], p[l] * yv[l]);
+                    else sy[l] += p[l] * yv[l];
+                }
+            }
+            for (size_t l = 0; l < L; l++) p[l] *= xv[l];
+        }
+    }
+
+    for (size_t j = 0; j < 2 * k + 1; j++) {
+        S[j] = 0.;
+        for (size_t l = 0; l < L; l++) S[j] += accS[j * L + l] + compS[j * L + l];
+    }
+    for (size_t j = 0; j < k + 1; j++) {
+        Sy[j] = 0.;
+        for (size_t l = 0; l < L; l++) Sy[j] += accY[j * L + l] + compY[j * L + l];
+    }
+    Syy = 0.;
+    for (size_t l = 0; l < L; l++) Syy += accYY[l] + compYY[l];
+
+}
+
+// Calculate the sufficient statistics up to order k of the float columns
+// The sums of the scaled y are converted to the sums of y centered on the
+// ycenter of the columns, in their scaling of x. w may be NULL for unit
+// weights.
+// **************************************************************
+void BuildSufficientStatsFloat(const FloatColumns& cols, const double* w, const size_t order, const bool compensated,
+    SufficientStats& stats) {
+
+    stats = SufficientStats();
+    stats.order = order;
+    stats.n = (double)cols.n;
+    stats.center = cols.xcenter;
+    stats.scale = cols.xscale;
+    stats.xmin = cols.xcenter - cols.xscale;
+    stats.xmax = cols.xcenter + cols.xscale;
+    stats.ycenter = cols.ycenter;
+    stats.S.assign(2 * order + 1, 0.);
+    stats.Sy.assign(order + 1, 0.);
+
+    double Syf2 = 0.;
+    if (compensated) AccumulateFloatLanes<true>(cols, w, order, stats.S.data(), stats.Sy.data(), Syf2);
+    else AccumulateFloatLanes<false>(cols, w, order, stats.S.data(), stats.Sy.data(), Syf2);
+
+    // y - ycenter = yscale * yf
+    for (size_t j = 0; j < order + 1; j++) stats.Sy[j] *= cols.yscale;
+    stats.Syy = cols.yscale * cols.yscale * Syf2;
+
+}
+
+// Parse the complete lines of a chunk of a csv file into x and y
+// The incomplete last line is kept in partial for the next chunk, and the
+// header is skipped if header is set.
+// **************************************************************
+void ParseCSVChunk(const char* data, const size_t length, std::string& partial, bool& header,
+    std::vector<double>& x, std::vector<double>& y) {
+
+    partial.append(data, length);
+    size_t begin = 0;
+    size_t eol;
+    while ((eol = partial.find('\n', begin)) != std::string::npos) {
+        if (header) {
+            header = false;
+        }
+        else {
+            double values[4];
+            int count = 0;
+            const char* p = partial.c_str() + begin;
+            const char* end = partial.c_str() + eol;
+            while (count < 4 && p < end) {
+                char* next;
+                values[count] = strtod(p, &next);
+                if (next == p) break;
+                count++;
+                p = next;
+                while (p < end && *p != ',') p++;
+                if (p < end) p++;
+            }
+            if (count == 4) {
+                x.push_back(values[0]);
+                y.push_back(values[1]);
+            }
+        }
+        begin = eol + 1;
+    }
+    partial.erase(0, begin);
+
+}
+
+// Fit the csv file and refit it every time rows are appended to it
+// The file is watched with inotify; only the bytes after the last offset
+// are read and parsed, and the new rows are added to the sufficient
+// statistics, so an update costs O(new rows * k). The scaling of x is set
+// by the first rows and the statistics are rescaled when new rows reach
+// beyond twice its half range (or when the first rows had a single x). The
+// file is parsed again if it is truncated, and the watch stops when it is
+// removed or renamed.
+// **************************************************************
+int WatchCSV(const char* filename, const size_t k, const bool fixedinter, const double fixedinterval,
+    const double alphaval) {
+
+#ifdef __linux__
+    int fd = open(filename, O_RDONLY);
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || ifd < 0 || inotify_add_watch(ifd, filename, IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        perror("Error watching input file");
+        if (fd >= 0) close(fd);
+        if (ifd >= 0) close(ifd);
+        return 1;
+    }
+
+    SufficientStats stats;
+    off_t offset = 0;
+    std::string partial;
+    bool header = true;
+    std::vector<char> chunk(1 << 20);
+    std::vector<double> x, y, w;
+    bool gone = false;
+
+    cout << "Watching " << filename << " (degree " << k << ")" << endl;
+    cout << "n\tnew\tbytes\tR2\tRMSE\tlatency_ms\tcoefficients" << endl;
+
+    while (!gone) {
+
+        auto t0 = std::chrono::steady_clock::now();
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_nlink == 0) break;     // Removed (the open file keeps the inode)
+        if (st.st_size < offset) {
+            offset = 0;                              // Truncated: start again
+            partial.clear();
+            header = true;
+            stats = SufficientStats();
+        }
+
+        // Parse the appended bytes only
+        size_t bytes = 0;
+        x.clear();
+        y.clear();
+        while (offset < st.st_size) {
+            ssize_t count = pread(fd, chunk.data(), chunk.size(), offset);
+            if (count <= 0) break;
+            ParseCSVChunk(chunk.data(), count, partial, header, x, y);
+            offset += count;
+            bytes += count;
+        }
+
+        if (!x.empty()) {
+            if (stats.n == 0.) {
+                BuildSufficientStats(x.data(), y.data(), std::vector<double>(x.size(), 1.).data(), x.size(), k,
+                    stats);
+            }
+            else {
+                double xmin = min(stats.xmin, *std::min_element(x.begin(), x.end()));
+                double xmax = max(stats.xmax, *std::max_element(x.begin(), x.end()));
+                double reach = max(stats.center - xmin, xmax - stats.center) / stats.scale;
+                if (reach > 2. || (stats.xmax == stats.xmin && xmax > xmin)) {
+                    RescaleSufficientStats(stats, 0.5 * (xmin + xmax), 0.5 * (xmax - xmin));
+                }
+                w.assign(x.size(), 1.);
+                AccumulateSufficientStats(stats, x.data(), y.data(), w.data(), x.size());
+            }
+
+            FitResult result;
+            bool solved = stats.n > k + 1 && SolveSufficientStats(stats, k, fixedinter, fixedinterval, alphaval,
+                result);
+            if (!result.message.empty()) cout << result.message << endl;
+            if (solved) {
+                auto t1 = std::chrono::steady_clock::now();
+                cout << result.n << "\t" << x.size() << "\t" << bytes << "\t" << result.R2 << "\t" << result.SE;
+                cout << "\t" << std::chrono::duration<double, std::milli>(t1 - t0).count() << "\t";
+                for (size_t j = 0; j < k + 1; j++) cout << (j ? "," : "") << result.beta[j];
+                cout << endl;
+            }
+        }
+
+        // Wait for the next change of the file
+        char events[4096];
+        ssize_t length = read(ifd, events, sizeof(events));
+        if (length <= 0) break;
+        for (char* p = events; p < events + length;) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) gone = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    cout << "Stopped watching " << filename << endl;
+    close(ifd);
+    close(fd);
+    return 0;
+#else
+    cout << "The watch mode needs inotify (Linux)" << endl;
+    return 1;
+#endif
+
+}
+
+// Bivariate polynomial z = f(x, y) in the scaled variables
+// u = (x - xcenter) / xscale and v = (y - ycenter) / yscale
+// The terms u^i v^j are ordered by i then j, with j <= dy for a tensor
+// product and i + j <= dx for a total degree dx.
+// **************************************************************
+struct SurfacePoly {
+    size_t dx = 0;                                   // Degree in u (total degree if !tensor)
+    size_t dy = 0;                                   // Degree in v (tensor product only)
+    bool tensor = false;
+    double xcenter = 0.;
+    double xscale = 1.;
+    double ycenter = 0.;
+    double yscale = 1.;
+    std::vector<double> coefs;                       // Coefficients of the terms
+};
+
+// Calculate the highest power of v of the terms in u^i
+// **************************************************************
+inline size_t SurfaceDegreeV(const SurfacePoly& sp, const size_t i) {
+
+    return sp.tensor ? sp.dy : sp.dx - i;
+
+}
+
+// Calculate the number of terms of the surface
+// **************************************************************
+size_t SurfaceTerms(const SurfacePoly& sp) {
+
+    size_t p = 0;
+    for (size_t i = 0; i <= sp.dx; i++) p += SurfaceDegreeV(sp, i) + 1;
+    return p;
+
+}
+
+// Calculate the surface at the n points (x,y), in parallel by blocks
+// Each point is evaluated with a nested Horner scheme: z = sum_i u^i q_i(v).
+// **************************************************************
+void EvaluateSurface(const SurfacePoly& sp, const double* x, const double* y, const size_t n, double* z) {
+
+    const size_t block = 1024;
+    std::vector<size_t> start(sp.dx + 1);            // Index of the first term in u^i
+    for (size_t i = 0, t = 0; i <= sp.dx; i++) {
+        start[i] = t;
+        t += SurfaceDegreeV(sp, i) + 1;
+    }
+
+    ParallelFor((n + block - 1) / block, [&](size_t b) {
+        size_t end = min(n, (b + 1) * block);
+        for (size_t r = b * block; r < end; r++) {
+            double u = (x[r] - sp.xcenter) / sp.xscale;
+            double v = (y[r] - sp.ycenter) / sp.yscale;
+            double poly = 0.;
+            for (size_t i = sp.dx + 1; i-- > 0;) {
+                const double* c = &sp.coefs[start[i]];
+                size_t deg = SurfaceDegreeV(sp, i);
+                double q = c[deg];
+                for (size_t j = deg; j-- > 0;) q = q * v + c[j];
+                poly = poly * u + q;
+            }
+            z[r] = poly;
+        }
+    });
+
+}
+
+// Accumulate XTWX [p,p] and XTWZ [p] of the surface fit
+// The entry of XTWX for the terms u^i1 v^j1 and u^i2 v^j2 is the moment
+// M[i1+i2][j1+j2] = sum of w u^(i1+i2) v^(j1+j2), so only the moments
+// (2dx+1 x 2dy+1, or a + b <= 2dx for a total degree) are accumulated, as
+// the power sums of PolyFit. The points are processed by blocks of
+// SURFACELANES with the powers of u and v computed by recurrence and one
+// partial sum per lane, so the loops over the lanes vectorize. The points
+// are split in chunks accumulated in parallel, then summed.
+// **************************************************************
+#define SURFACELANES 8
+
+void AccumulateSurfaceGram(const SurfacePoly& sp, const double* x, const double* y, const double* z, const double* w,
+    const size_t n, double** XTWX, double* XTWZ) {
+
+    const size_t L = SURFACELANES;
+    size_t na = 2 * sp.dx + 1;                       // Powers of u in the moments
+    size_t nb = 2 * (sp.tensor ? sp.dy : sp.dx) + 1; // Powers of v in the moments
+    size_t nm = na * nb;
+    size_t nblocks = (n + L - 1) / L;
+    size_t nchunks = min((size_t)max(std::thread::hardware_concurrency(), 1u), max(nblocks, (size_t)1));
+    std::vector<std::vector<double> > moments(nchunks, std::vector<double>((nm + nm) * L, 0.));
+
+    ParallelFor(nchunks, [&](size_t c) {
+        std::vector<double> wu(na * L), wzu(na * L), vp(nb * L);
+        double* M = moments[c].data();              // Moments of w [na][nb][L]
+        double* MZ = M + nm * L;                     // Moments of w z [na][nb][L]
+
+        for (size_t b = c * nblocks / nchunks; b < (c + 1) * nblocks / nchunks; b++) {
+            size_t r0 = b * L;
+            size_t count = min(L, n - r0);
+            double u[L], v[L];
+            for (size_t l = 0; l < L; l++) {
+                bool valid = l < count;
+                u[l] = valid ? (x[r0 + l] - sp.xcenter) / sp.xscale : 0.;
+                v[l] = valid ? (y[r0 + l] - sp.ycenter) / sp.yscale : 0.;
+                wu[l] = valid ? w[r0 + l] : 0.;
+                wzu[l] = valid ? w[r0 + l] * z[r0 + l] : 0.;
+                vp[l] = 1.;
+            }
+            for (size_t a = 1; a < na; a++) {
+                for (size_t l = 0; l < L; l++) {
+                    wu[a * L + l] = wu[(a - 1) * L + l] * u[l];
+                    wzu[a * L + l] = wzu[(a - 1) * L + l] * u[l];
+                }
+            }
+            for (size_t e = 1; e < nb; e++) {
+                for (size_t l = 0; l < L; l++) vp[e * L + l] = vp[(e - 1) * L + l] * v[l];
+            }
+
+            for (size_t a = 0; a < na; a++) {
+                size_t emax = sp.tensor ? nb : na - a;   // a + e <= 2 dx for a total degree
+                for (size_t e = 0; e < emax; e++) {
+                    double* m = M + (a * nb + e) * L;
+                    double* mz = MZ + (a * nb + e) * L;
+                    for (size_t l = 0; l < L; l++) {
+                        m[l] += wu[a * L + l] * vp[e * L + l];
+                        mz[l] += wzu[a * L + l] * vp[e * L + l];
+                    }
+                }
+            }
+        }
+    });
+
+    std::vector<double> M(nm, 0.), MZ(nm, 0.);
+    for (size_t c = 0; c < nchunks; c++) {
+        for (size_t i = 0; i < nm; i++) {
+            for (size_t l = 0; l < L; l++) {
+                M[i] += moments[c][i * L + l];
+                MZ[i] += moments[c][(nm + i) * L + l];
+            }
+        }
+    }
+
+    for (size_t i1 = 0, t1 = 0; i1 <= sp.dx; i1++) {
+        for (size_t j1 = 0; j1 <= SurfaceDegreeV(sp, i1); j1++, t1++) {
+            XTWZ[t1] = MZ[i1 * nb + j1];
+            for (size_t i2 = 0, t2 = 0; i2 <= sp.dx; i2++) {
+                for (size_t j2 = 0; j2 <= SurfaceDegreeV(sp, i2); j2++, t2++) {
+                    XTWX[t1][t2] = M[(i1 + i2) * nb + j1 + j2];
+                }
+            }
+        }
+    }
+
+}
+
+// Perform the fit of the surface z = f(x, y) with the weights w
+// The scaling of sp is set on the range of x and y. XTWXInv [p,p] receives
+// the inverse of XTWX. Points along a curve (a track) do not determine the
+// high degree terms: if XTWX is not positive definite, its diagonal is
+// increased by a relative ridge lambda (1e-12 to 1e-4), returned in lambda.
+// Returns false if XTWX cannot be factored.
+// **************************************************************
+bool PolyFitSurface(const double* x, const double* y, const double* z, const double* w, const size_t n,
+    SurfacePoly& sp, double** XTWXInv, double* lambda) {
+
+    size_t p = SurfaceTerms(sp);
+    double xmin = *std::min_element(x, x + n), xmax = *std::max_element(x, x + n);
+    double ymin = *std::min_element(y, y + n), ymax = *std::max_element(y, y + n);
+    sp.xcenter = 0.5 * (xmin + xmax);
+    sp.xscale = (xmax > xmin) ? 0.5 * (xmax - xmin) : 1.;
+    sp.ycenter = 0.5 * (ymin + ymax);
+    sp.yscale = (ymax > ymin) ? 0.5 * (ymax - ymin) : 1.;
+    sp.coefs.assign(p, 0.);
+
+    double** XTWX = Make2DArray(p, p);
+    double** L = Make2DArray(p, p);
+    double* XTWZ = new double[p];
+    double* D = new double[p];
+
+    ProfileScope accumulate("accumulate");
+    AccumulateSurfaceGram(sp, x, y, z, w, n, XTWX, XTWZ);
+    accumulate.Stop();
+
+    ProfileScope factor("factor");
+    bool ok = CholeskyDecomp(XTWX, L, D, p);
+    *lambda = 0.;
+    std::vector<double> diagonal(p);
+    for (size_t i = 0; i < p; i++) diagonal[i] = XTWX[i][i];
+    for (double ridge = 1.e-12; !ok && ridge <= 1.e-4; ridge *= 100.) {
+        for (size_t i = 0; i < p; i++) XTWX[i][i] = diagonal[i] * (1. + ridge);
+        ok = CholeskyDecomp(XTWX, L, D, p);
+        *lambda = ridge;
+    }
+    if (ok) {
+        CholeskySolve(L, D, XTWZ, sp.coefs.data(), p);
+        CholeskyInverse(L, D, XTWXInv, p);
+    }
+    factor.Stop();
+
+    Free2DArray(XTWX, p);
+    Free2DArray(L, p);
+    delete[] XTWZ;
+    delete[] D;
+
+    return ok;
+
+}
+
+// Fit the surface z = f(x, y), display the results and write the surface
+// on a grid over the range of the data to Surface.dat
+// **************************************************************
+void FitSurface(const double* x, const double* y, const double* z, const char* name, const size_t n,
+    const size_t dx, const size_t dy, const bool tensor, const double alphaval, const double* w) {
+
+    SurfacePoly sp;
+    sp.dx = dx;
+    sp.dy = tensor ? dy : 0;
+    sp.tensor = tensor;
+    size_t p = SurfaceTerms(sp);
+    size_t nstar = n - 1;
+    size_t k = p - 1;                                // Number of terms besides the intercept
+
+    cout << "Surface fit of " << name << " = f(x, y), ";
+    if (tensor) cout << "tensor product of degree " << dx << " x " << dy;
+    else cout << "total degree " << dx;
+    cout << " (" << p << " terms)" << endl;
+
+    if (p > nstar) {
+        cout << "The number of terms is too high for " << n << " points. Program stopped" << endl;
+        return;
+    }
+
+    double** XTWXInv = Make2DArray(p, p);
+    double lambda = 0.;
+    if (!PolyFitSurface(x, y, z, w, n, sp, XTWXInv, &lambda)) {
+        cout << "Matrix XTWX is not positive definite: the points do not determine the surface" << endl;
+        Free2DArray(XTWXInv, p);
+        return;
+    }
+    if (lambda > 0.) {
+        cout << "Matrix XTWX is not positive definite: the points do not determine all the terms, ";
+        cout << "using a ridge of " << lambda << " (standard errors are approximate)" << endl;
+    }
+
+    // Statistics from the batched evaluation of the surface
+    // **************************************************************
+    ProfileScope statistics("statistics");
+    std::vector<double> fit(n);
+    EvaluateSurface(sp, x, y, n, fit.data());
+    double RSS = 0.;
+    for (size_t i = 0; i < n; i++) RSS += w[i] * (z[i] - fit[i]) * (z[i] - fit[i]);
+    double TSS = CalculateTSS(z, w, false, n);
+    double R2 = 1. - RSS / TSS;
+    double R2Adj = 1. - (double)(n - 1) / (double)(n - p) * RSS / TSS;
+    double SE = (nstar > k) ? sqrt(RSS / (nstar - k)) : 0.;
+    double tstudentval = (nstar > k) ? fabs(CalculateTValueStudent(nstar - k, 1. - 0.5 * alphaval)) : 0.;
+    statistics.Stop();
+
+    cout << "u = (x - xc) / xs, v = (y - yc) / ys with xc = " << sp.xcenter << ", xs = " << sp.xscale;
+    cout << ", yc = " << sp.ycenter << ", ys = " << sp.yscale << endl;
+    cout << "t-student value: " << tstudentval << endl << endl;
+
+    cout << "Surface coefficients" << endl;
+    cout << "Term\tValue\tStdErr\tLowCI\tHighCI\tStudent-t\tProb>|t|" << endl;
+    for (size_t i = 0, t = 0; i <= sp.dx; i++) {
+        for (size_t j = 0; j <= SurfaceDegreeV(sp, i); j++, t++) {
+            double serbeta = SE * sqrt(XTWXInv[t][t]);
+            cout << "u^" << i << "v^" << j << "\t" << sp.coefs[t] << "\t" << serbeta << "\t";
+            cout << sp.coefs[t] - tstudentval * serbeta << "\t" << sp.coefs[t] + tstudentval * serbeta << "\t";
+            if (serbeta > 0) {
+                cout << sp.coefs[t] / serbeta << "\t" << 1. - cdfStudent(nstar - k, sp.coefs[t] / serbeta);
+            }
+            else {
+                cout << "-\t-";
+            }
+            cout << endl;
+        }
+    }
+
+    DisplayStatistics(n, nstar, k, RSS, R2, R2Adj, SE);
+    DisplayANOVA(nstar, k, TSS, RSS);
+
+    // Surface on a grid over the range of the data
+    // **************************************************************
+    ProfileScope grid("grid");
+    const size_t ng = 101;
+    std::vector<double> gx(ng * ng), gy(ng * ng), gz(ng * ng);
+    for (size_t a = 0; a < ng; a++) {
+        for (size_t b = 0; b < ng; b++) {
+            gx[a * ng + b] = sp.xcenter + sp.xscale * (-1. + 2. * a / (ng - 1));
+            gy[a * ng + b] = sp.ycenter + sp.yscale * (-1. + 2. * b / (ng - 1));
+        }
+    }
+    EvaluateSurface(sp, gx.data(), gy.data(), ng * ng, gz.data());
+
+    ofstream output;
+    output.open("Surface.dat");
+    output << "x\ty\t" << name;
+    for (size_t a = 0; a < ng; a++) {
+        output << endl;
+        for (size_t b = 0; b < ng; b++) {
+            output << endl << gx[a * ng + b] << "\t" << gy[a * ng + b] << "\t" << gz[a * ng + b];
+        }
+    }
+    output.close();
+    cout << "Surface written to Surface.dat" << endl;
+
+    Free2DArray(XTWXInv, p);
+
+}
+
+// Calculate the terms of the point (x,y) in a Levenberg-Marquardt step of
+// the orthogonal distance regression
+// t is the scaled shifted abscissa, r the residual in y, C the diagonal of
+// the shift and gdelta its gradient. The coupling of the shift with beta
+// is B[j] = bp phi[j](t) + br phi[j]'(t). With newton, C and B include the
+// second order terms r p'' and r phi', which the Gauss-Newton terms alone
+// lack when the residuals are large against the curvature; the point falls
+// back to Gauss-Newton if they make C small or negative.
+// **************************************************************
+inline void ODRPointTerms(const double x, const double y, const double wy, const double wx, const size_t k,
+    const double center, const double scale, const double* beta, const double delta, const double mu,
+    const bool newton, double* t, double* r, double* C, double* gdelta, double* bp, double* br) {
+
+    double p, dp, d2p;
+    *t = (x + delta - center) / scale;
+    calculatePolyDerivs(*t, beta, k, &p, &dp, &d2p);
+    dp /= scale;
+    d2p /= scale * scale;
+    *r = p - y;
+
+    double Cgn = wy * dp * dp + wx;
+    double Cnewton = Cgn + wy * *r * d2p;
+    *gdelta = wy * dp * *r + wx * delta;
+    *bp = wy * dp;
+    if (newton && Cnewton > 0.1 * Cgn) {
+        *C = Cnewton + mu * Cgn;
+        *br = wy * *r;
+    }
+    else {
+        *C = Cgn * (1. + mu);
+        *br = 0.;
+    }
+
+}
+
+// Accumulate the reduced normal equations of a Levenberg-Marquardt step of
+// the orthogonal distance regression
+// The unknowns are beta (in the scaled variable t = (x - center) / scale)
+// and one shift delta[i] of every x. The shifts only couple with beta, so
+// they are eliminated point by point (Schur complement): the step of beta
+// solves (A + mu diag(A) - sum B_i B_i' / C_i) dbeta = -gbeta + sum B_i gdelta_i / C_i
+// in O(n k^2). The points are accumulated in parallel chunks.
+// **************************************************************
+void AccumulateODRStep(const double* x, const double* y, const double* wy, const double* wx, const size_t n,
+    const size_t k, const double center, const double scale, const double* beta, const double* delta,
+    const double mu, const bool newton, double** S, double* rhs) {
+
+    size_t f = k + 1;
+    size_t nchunks = min((size_t)max(std::thread::hardware_concurrency(), 1u), max(n / 1024, (size_t)1));
+    std::vector<std::vector<double> > partial(nchunks, std::vector<double>(2 * f * f + f, 0.));
+
+    ParallelFor(nchunks, [&](size_t c) {
+        double* A = partial[c].data();              // sum wy phi phi'
+        double* R = A + f * f;                       // sum B B' / C
+        double* g = R + f * f;                       // -gbeta + sum B gdelta / C
+        std::vector<double> phi(f), B(f);
+        for (size_t i = c * n / nchunks; i < (c + 1) * n / nchunks; i++) {
+            double t, r, C, gdelta, bp, br;
+            ODRPointTerms(x[i], y[i], wy[i], wx[i], k, center, scale, beta, delta[i], mu, newton,
+                &t, &r, &C, &gdelta, &bp, &br);
+            double dphi = 0.;
+            phi[0] = 1.;
+            B[0] = bp;
+            for (size_t j = 1; j < f; j++) {
+                dphi = j * phi[j - 1] / scale;
+                phi[j] = phi[j - 1] * t;
+                B[j] = bp * phi[j] + br * dphi;
+            }
+            for (size_t j = 0; j < f; j++) {
+                g[j] += -wy[i] * r * phi[j] + B[j] * gdelta / C;
+                for (size_t l = j; l < f; l++) {
+                    A[j * f + l] += wy[i] * phi[j] * phi[l];
+                    R[j * f + l] += B[j] * B[l] / C;
+                }
+            }
+        }
+    });
+
+    for (size_t j = 0; j < f; j++) {
+        rhs[j] = 0.;
+        for (size_t c = 0; c < nchunks; c++) rhs[j] += partial[c][2 * f * f + j];
+        for (size_t l = j; l < f; l++) {
+            double a = 0., b = 0.;
+            for (size_t c = 0; c < nchunks; c++) {
+                a += partial[c][j * f + l];
+                b += partial[c][f * f + j * f + l];
+            }
+            if (l == j) a *= 1. + mu;
+            S[j][l] = a - b;
+            S[l][j] = a - b;
+        }
+    }
+
+}
+
+// Calculate the weighted sum of squares of the orthogonal distance
+// regression: sum wy (p(x + delta) - y)^2 + wx delta^2
+// **************************************************************
+double CalculateODRCost(const double* x, const double* y, const double* wy, const double* wx, const size_t n,
+    const size_t k, const double center, const double scale, const double* beta, const double* delta) {
+
+    size_t nchunks = min((size_t)max(std::thread::hardware_concurrency(), 1u), max(n / 1024, (size_t)1));
+    std::vector<double> partial(nchunks, 0.);
+
+    ParallelFor(nchunks, [&](size_t c) {
+        for (size_t i = c * n / nchunks; i < (c + 1) * n / nchunks; i++) {
+            double r = calculatePoly((x[i] + delta[i] - center) / scale, beta, k) - y[i];
+            partial[c] += wy[i] * r * r + wx[i] * delta[i] * delta[i];
+        }
+    });
+
+    double cost = 0.;
+    for (size_t c = 0; c < nchunks; c++) cost += partial[c];
+    return cost;
+
+}
+
+// Perform the orthogonal distance (errors-in-variables) fit of y = p(x)
+// with Levenberg-Marquardt, starting from beta (scaled variable, usually
+// the ordinary least squares) and delta = 0
+// wy and wx are the weights of the errors on y and x. On return, beta and
+// delta hold the solution and inverse the inverse of the reduced normal
+// matrix (the covariance of beta up to the variance). Returns the cost.
+// **************************************************************
+double PolyFitODR(const double* x, const double* y, const double* wy, const double* wx, const size_t n,
+    const size_t k, const double center, const double scale, double* beta, double* delta, double** inverse,
+    size_t* iterations) {
+
+    size_t f = k + 1;
+    double** S = Make2DArray(f, f);
+    double** L = Make2DArray(f, f);
+    double* D = new double[f];
+    double* rhs = new double[f];
+    double* step = new double[f];
+    std::vector<double> trialbeta(f), trialdelta(n);
+
+    for (size_t i = 0; i < n; i++) delta[i] = 0.;
+    double cost = CalculateODRCost(x, y, wy, wx, n, k, center, scale, beta, delta);
+    double mu = 1.e-3;
+
+    *iterations = 0;
+    while (*iterations < MAXIT && mu < 1.e10) {
+
+        AccumulateODRStep(x, y, wy, wx, n, k, center, scale, beta, delta, mu, true, S, rhs);
+        if (!CholeskyDecomp(S, L, D, f)) {
+            mu *= 10.;
+            continue;
+        }
+        CholeskySolve(L, D, rhs, step, f);
+        for (size_t j = 0; j < f; j++) trialbeta[j] = beta[j] + step[j];
+
+        // Step of the shifts from the step of beta, point by point
+        ParallelFor((n + 1023) / 1024, [&](size_t b) {
+            for (size_t i = b * 1024; i < min(n, (b + 1) * 1024); i++) {
+                double t, r, C, gdelta, bp, br, q, dq, d2q;
+                ODRPointTerms(x[i], y[i], wy[i], wx[i], k, center, scale, beta, delta[i], mu, true,
+                    &t, &r, &C, &gdelta, &bp, &br);
+                calculatePolyDerivs(t, step, k, &q, &dq, &d2q);
+                trialdelta[i] = delta[i] - (gdelta + bp * q + br * dq / scale) / C;
+            }
+        });
+
+        double trialcost = CalculateODRCost(x, y, wy, wx, n, k, center, scale, trialbeta.data(), trialdelta.data());
+        (*iterations)++;
+        if (trialcost < cost) {
+            bool converged = cost - trialcost <= 1.e-10 * cost;
+            std::copy(trialbeta.begin(), trialbeta.end(), beta);
+            std::copy(trialdelta.begin(), trialdelta.end(), delta);
+            cost = trialcost;
+            mu = max(0.1 * mu, 1.e-12);
+            if (converged) break;
+        }
+        else {
+            mu *= 10.;
+        }
+    }
+
+    // Reduced normal matrix at the solution, without damping
+    AccumulateODRStep(x, y, wy, wx, n, k, center, scale, beta, delta, 0., false, S, rhs);
+    if (CholeskyDecomp(S, L, D, f)) {
+        CholeskyInverse(L, D, inverse, f);
+    }
+    else {
+        cofactor(S, inverse, f);
+    }
+
+    Free2DArray(S, f);
+    Free2DArray(L, f);
+    delete[] D;
+    delete[] rhs;
+    delete[] step;
+
+    return cost;
+
+}
+
+// Fit y = p(x) with errors on both x and y and display the results
+// ratio is the ratio of the variances of the errors on y and on x (1 for
+// the orthogonal distance). The fit is started from the ordinary least
+// squares fit; the shifted points (x + delta, p(x + delta)) are written to
+// ODR.dat.
+// **************************************************************
+void FitODR(const double* x, const double* y, const size_t n, const size_t k, const double ratio,
+    const double alphaval, const double* w) {
+
+    size_t f = k + 1;
+    size_t nstar = n - 1;
+    double xmin = *std::min_element(x, x + n), xmax = *std::max_element(x, x + n);
+    double center = 0.5 * (xmin + xmax);
+    double scale = (xmax > xmin) ? 0.5 * (xmax - xmin) : 1.;
+
+    std::vector<double> t(n), wx(n), delta(n);
+    for (size_t i = 0; i < n; i++) {
+        t[i] = (x[i] - center) / scale;
+        wx[i] = w[i] * ratio;
+    }
+
+    // Ordinary least squares start
+    // **************************************************************
+    double* scaled = new double[f];
+    double* S = new double[2 * k + 1];
+    double** XTWY = Make2DArray(1, f);
+    double** inverse = Make2DArray(f, f);
+    double** rawinverse = Make2DArray(f, f);
+    double* beta[1] = { scaled };
+    double* Y[1] = { (double*)y };
+    for (size_t j = 0; j < 2 * k + 1; j++) S[j] = 0.;
+    AccumulatePowerSums(t.data(), Y, w, n, 1, k, S, XTWY);
+    SolvePowerSums(S, XTWY, 1, k, false, 0., beta, inverse);
+    double RSSols = CalculateRSS(t.data(), y, scaled, w, n, f);
+
+    size_t iterations = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    double cost = PolyFitODR(x, y, w, wx.data(), n, k, center, scale, scaled, delta.data(), inverse, &iterations);
+    auto t1 = std::chrono::steady_clock::now();
+
+    double RSS = CalculateRSS(t.data(), y, scaled, w, n, f);
+    double SE = (nstar > k) ? sqrt(cost / (nstar - k)) : 0.;
+    double tstudentval = (nstar > k) ? fabs(CalculateTValueStudent(nstar - k, 1. - 0.5 * alphaval)) : 0.;
+    double rmsdelta = 0.;
+    for (size_t i = 0; i < n; i++) rmsdelta += delta[i] * delta[i];
+    rmsdelta = sqrt(rmsdelta / n);
+
+    double* coefbeta = new double[f];
+    double* serbeta = new double[f];
+    ScaledToRaw(scaled, inverse, k, center, scale, coefbeta, rawinverse);
+    CalculateSERRBeta(false, SE, k, serbeta, rawinverse);
+
+    cout << "Orthogonal distance regression (variance ratio y/x: " << ratio << ")" << endl;
+    cout << "Levenberg-Marquardt iterations: " << iterations << " (";
+    cout << std::chrono::duration<double>(t1 - t0).count() * 1000. << " ms)" << endl;
+    cout << "t-student value: " << tstudentval << endl << endl;
+
+    DisplayPolynomial(k);
+    DisplayCoefs(k, nstar, tstudentval, coefbeta, serbeta);
+
+    cout << endl;
+    cout << "Statistics" << endl;
+    cout << "Number of points: " << n << endl;
+    cout << "Degrees of freedom: " << nstar - k << endl;
+    cout << "Weighted sum of squares (x and y): " << cost << endl;
+    cout << "Residual sum of squares in y: " << RSS << " (ordinary least squares: " << RSSols << ")" << endl;
+    cout << "RMS shift of x: " << rmsdelta << endl;
+    cout << "RMSE: " << SE << endl << endl;
+
+    DisplayCovCorrMatrix(k, SE, false, rawinverse);
+
+    ofstream output;
+    output.open("ODR.dat");
+    output << "x\ty\tx_fit\ty_fit";
+    for (size_t i = 0; i < n; i++) {
+        output << endl << x[i] << "\t" << y[i] << "\t" << x[i] + delta[i] << "\t";
+        output << calculatePoly((x[i] + delta[i] - center) / scale, scaled, k);
+    }
+    output.close();
+    cout << "Shifted points written to ODR.dat" << endl;
+
+    delete[] scaled;
+    delete[] S;
+    delete[] coefbeta;
+    delete[] serbeta;
+    Free2DArray(XTWY, 1);
+    Free2DArray(inverse, f);
+    Free2DArray(rawinverse, f);
+
+}
+
+// Configuration of the fit sweep and its result
+// **************************************************************
+struct SweepConfig {
+    size_t k = 0;                                    // Polynomial order
+    size_t scheme = 0;                               // Index of the weighting scheme
+    size_t intercept = 0;                            // Index of the intercept setting
+    bool fixedinter = false;                         // Fixed the intercept
+    double fixedinterval = 0.;                       // The fixed intercept value
+    double alphaval = 0.05;                          // Critical alpha value
+    bool solved = false;
+    FitResult result;
+};
+
+// Accumulate the sufficient statistics of m weighting schemes in one pass
+// W[s] are the weights of the scheme s. The powers of the scaled x are
+// computed once per block of SWEEPLANES points and shared by the schemes,
+// with one partial sum per lane so the loops over the lanes vectorize. The
+// points are split in chunks accumulated in parallel. y is centered on its
+// mean for all the schemes.
+// **************************************************************
+#define SWEEPLANES 8
+
+void BuildSweepStats(const double* x, const double* y, double** W, const size_t m, const size_t n,
+    const size_t order, std::vector<SufficientStats>& stats) {
+
+    const size_t L = SWEEPLANES;
+    const size_t nacc = (3 * order + 3) * L;        // Lanes of S [2K+1], Sy [K+1] and Syy per scheme
+    double xmin = *std::min_element(x, x + n);
+    double xmax = *std::max_element(x, x + n);
+    double center = 0.5 * (xmin + xmax);
+    double scale = (xmax > xmin) ? 0.5 * (xmax - xmin) : 1.;
+    double ycenter = 0.;
+    for (size_t i = 0; i < n; i++) ycenter += y[i];
+    ycenter /= n;
+
+    size_t nblocks = (n + L - 1) / L;
+    size_t nchunks = min((size_t)max(std::thread::hardware_concurrency(), 1u), max(nblocks / 128, (size_t)1));
+    std::vector<std::vector<double> > partial(nchunks, std::vector<double>(m * nacc, 0.));
+
+    ParallelFor(nchunks, [&](size_t c) {
+        std::vector<double> wv(m * L);
+        for (size_t b = c * nblocks / nchunks; b < (c + 1) * nblocks / nchunks; b++) {
+            size_t i0 = b * L;
+            size_t count = min(L, n - i0);
+            double xv[L], yv[L], p[L];
+            for (size_t l = 0; l < L; l++) {
+                bool valid = l < count;
+                xv[l] = valid ? (x[i0 + l] - center) / scale : 0.;
+                yv[l] = valid ? y[i0 + l] - ycenter : 0.;
+                p[l] = 1.;
+                for (size_t s = 0; s < m; s++) wv[s * L + l] = valid ? W[s][i0 + l] : 0.;
+            }
+            for (size_t s = 0; s < m; s++) {
+                double* accYY = partial[c].data() + s * nacc + (3 * order + 2) * L;
+                const double* ws = wv.data() + s * L;
+                for (size_t l = 0; l < L; l++) accYY[l] += ws[l] * yv[l] * yv[l];
+            }
+            for (size_t j = 0; j < 2 * order + 1; j++) {
+                for (size_t s = 0; s < m; s++) {
+                    double* accS = partial[c].data() + s * nacc + j * L;
+                    const double* ws = wv.data() + s * L;
+                    for (size_t l = 0; l < L; l++) accS[l] += ws[l] * p[l];
+                    if (j < order + 1) {
+                        double* accY = partial[c].data() + s * nacc + (2 * order + 1 + j) * L;
+                        for (size_t l = 0; l < L; l++) accY[l] += ws[l] * p[l] * yv[l];
+                    }
+                }
+                for (size_t l = 0; l < L; l++) p[l] *= xv[l];
+            }
+        }
+    });
+
+    stats.assign(m, SufficientStats());
+    for (size_t s = 0; s < m; s++) {
+        stats[s].order = order;
+        stats[s].n = (double)n;
+        stats[s].center = center;
+        stats[s].scale = scale;
+        stats[s].xmin = xmin;
+        stats[s].xmax = xmax;
+        stats[s].ycenter = ycenter;
+        stats[s].S.assign(2 * order + 1, 0.);
+        stats[s].Sy.assign(order + 1, 0.);
+        for (size_t c = 0; c < nchunks; c++) {
+            const double* acc = partial[c].data() + s * nacc;
+            for (size_t l = 0; l < L; l++) {
+                for (size_t j = 0; j < 2 * order + 1; j++) stats[s].S[j] += acc[j * L + l];
+                for (size_t j = 0; j < order + 1; j++) stats[s].Sy[j] += acc[(2 * order + 1 + j) * L + l];
+                stats[s].Syy += acc[(3 * order + 2) * L + l];
+            }
+        }
+    }
+
+}
+
+// Fit every combination of the degrees, weighting schemes, intercepts and
+// alpha values and display them in one comparison table
+// The data are read once for all the configurations: the sufficient
+// statistics of every weighting scheme are accumulated in a single pass,
+// then the configurations are solved from them in parallel. An empty
+// intercept value means a free A0. The weights 1 and 2 need the errors on
+// y (erry, nerry values, from --sigma); the schemes without them are skipped.
+// **************************************************************
+bool FitSweep(const double* x, const double* y, const size_t n, const double* erry, const size_t nerry,
+    const std::vector<size_t>& degrees, const std::vector<int>& wtypes, const std::vector<std::string>& intercepts,
+    const std::vector<double>& alphas) {
+
+    const char* wnames[3] = { "none", "sigma", "1/sigma^2" };
+
+    // Weights of the schemes
+    // **************************************************************
+    std::vector<int> schemes;
+    std::vector<std::vector<double> > weights;
+    for (size_t s = 0; s < wtypes.size(); s++) {
+        int type = wtypes[s];
+        if (type < 0 || type > 2 || std::find(schemes.begin(), schemes.end(), type) != schemes.end()) continue;
+        if (type > 0 && nerry < n) {
+            cout << "Weights " << wnames[type] << " need the errors on y of every point: skipped" << endl;
+            continue;
+        }
+        std::vector<double> w(n);
+        CalculateWeights(erry, w.data(), n, type);
+        if (std::find(w.begin(), w.end(), 0.) != w.end()) {
+            cout << "Weights " << wnames[type] << ": one or more points have 0 error: skipped" << endl;
+            continue;
+        }
+        schemes.push_back(type);
+        weights.push_back(w);
+    }
+    if (schemes.empty() || degrees.empty()) {
+        cout << "No configuration to fit. Program stopped" << endl;
+        return false;
+    }
+
+    // One pass over the data
+    // **************************************************************
+    size_t order = *std::max_element(degrees.begin(), degrees.end());
+    std::vector<double*> W(schemes.size());
+    for (size_t s = 0; s < schemes.size(); s++) W[s] = weights[s].data();
+    std::vector<SufficientStats> stats;
+
+    auto t0 = std::chrono::steady_clock::now();
+    BuildSweepStats(x, y, W.data(), schemes.size(), n, order, stats);
+    auto t1 = std::chrono::steady_clock::now();
+
+    // All the configurations, solved in parallel
+    // **************************************************************
+    std::vector<SweepConfig> configs;
+    for (size_t d = 0; d < degrees.size(); d++) {
+        for (size_t s = 0; s < schemes.size(); s++) {
+            for (size_t a = 0; a < intercepts.size(); a++) {
+                for (size_t b = 0; b < alphas.size(); b++) {
+                    SweepConfig config;
+                    config.k = degrees[d];
+                    config.scheme = s;
+                    config.intercept = a;
+                    config.fixedinter = !intercepts[a].empty();
+                    config.fixedinterval = config.fixedinter ? atof(intercepts[a].c_str()) : 0.;
+                    config.alphaval = alphas[b];
+                    configs.push_back(config);
+                }
+            }
+        }
+    }
+
+    ParallelFor(configs.size(), [&](size_t c) {
+        SweepConfig& config = configs[c];
+        config.solved = SolveSufficientStats(stats[config.scheme], config.k, config.fixedinter,
+            config.fixedinterval, config.alphaval, config.result);
+    });
+    auto t2 = std::chrono::steady_clock::now();
+
+    // Lowest AIC of every weighting scheme and intercept (the RSS of
+    // different weights are not comparable)
+    // **************************************************************
+    std::vector<double> aic(configs.size(), 0.);
+    std::map<std::pair<size_t, size_t>, size_t> best;
+    for (size_t c = 0; c < configs.size(); c++) {
+        const SweepConfig& config = configs[c];
+        if (!config.solved) continue;
+        size_t p = config.k + (config.fixedinter ? 0 : 1);
+        aic[c] = n * log(max(config.result.RSS, 1.e-300) / n) + 2. * p;
+        std::pair<size_t, size_t> key(config.scheme, config.intercept);
+        if (best.find(key) == best.end() || aic[c] < aic[best[key]]) best[key] = c;
+    }
+
+    cout << "Sweep of " << configs.size() << " configurations (" << schemes.size() << " weighting schemes)" << endl;
+    cout << "Data pass: " << std::chrono::duration<double>(t1 - t0).count() * 1000. << " ms, ";
+    cout << "solve: " << std::chrono::duration<double>(t2 - t1).count() * 1000. << " ms" << endl << endl;
+
+    cout << "Degree\tWeights\tA0\tAlpha\tRSS\tR2\tR2Adj\tRMSE\tt-student\tSignif\tAIC" << endl;
+    for (size_t c = 0; c < configs.size(); c++) {
+        const SweepConfig& config = configs[c];
+        const FitResult& r = config.result;
+        cout << config.k << "\t" << wnames[schemes[config.scheme]] << "\t";
+        if (config.fixedinter) cout << config.fixedinterval;
+        else cout << "free";
+        cout << "\t" << config.alphaval << "\t";
+        if (!config.solved) {
+            cout << "-\t" << r.message << endl;
+            continue;
+        }
+
+        // All the adjusted coefficients significant at alpha
+        bool signif = true;
+        for (size_t j = config.fixedinter ? 1 : 0; j < config.k + 1; j++) {
+            if (fabs(r.beta[j]) <= r.tstudentval * r.serbeta[j]) signif = false;
+        }
+
+        cout << r.RSS << "\t" << r.R2 << "\t" << r.R2Adj << "\t" << r.SE << "\t" << r.tstudentval << "\t";
+        cout << (signif ? "yes" : "no") << "\t" << aic[c];
+        if (best[std::make_pair(config.scheme, config.intercept)] == c) cout << " *";
+        cout << endl;
+    }
+    cout << endl << "* lowest AIC for its weights and intercept" << endl;
+
+    // Warnings of the solved configurations, after the table
+    for (size_t c = 0; c < configs.size(); c++) {
+        const SweepConfig& config = configs[c];
+        if (!config.solved || config.result.message.empty()) continue;
+        cout << "Degree " << config.k << ", weights " << wnames[schemes[config.scheme]] << ", A0 ";
+        if (config.fixedinter) cout << config.fixedinterval;
+        else cout << "free";
+        cout << ": " << config.result.message << endl;
+    }
+
+    return true;
+
+}
+
+// Display the command line usage
+// **************************************************************
+void PrintUsage(const char* program) {
+
+    std::cerr << "Usage: " << program << " <input file> [options]\n";
+    std::cerr << "       " << program << " --serve <socket> [--threads <t>] [--queue <q>] [--cache <d>]\n";
+    std::cerr << "       " << program << " --merge <output summary> <summary> [<summary> ...]\n";
+    std::cerr << "Options:\n";
+    std::cerr << "  --degree <k>    Degree of the polynomial (default 4)\n";
+    std::cerr << "  --multi         Fit y, R_c and V_target against x with one factorization\n";
+    std::cerr << "  --parametric    Fit the track x(s), y(s) as a function of its arc length s\n";
+    std::cerr << "  --periodic      Close the parametric curve (position, heading, curvature)\n";
+    std::cerr << "  --segments <m>  Piecewise fit with up to m segments found from the RSS\n";
+    std::cerr << "  --breaks <list> Piecewise fit with the given comma separated breakpoints\n";
+    std::cerr << "  --continuity <c> Enforce C0, C1 or C2 continuity between the segments\n";
+    std::cerr << "  --roots         Find the extrema and inflection points of the (piecewise) fit\n";
+    std::cerr << "  --level <c>     Also find the crossings of the level c\n";
+    std::cerr << "  --lut <err>     Compile the (piecewise) fit into a lookup table with max error err\n";
+    std::cerr << "  --ridge         Ridge fit, lambda selected by generalized cross-validation\n";
+    std::cerr << "  --lambda <l>    Ridge fit with the given (relative) lambda\n";
+    std::cerr << "  --decimate <d>  Fit a decimated subset: stride, arclength, curvature or leverage\n";
+    std::cerr << "  --target <m>    Number of points kept by the decimation (default 512)\n";
+    std::cerr << "  --tolerance <t> Refine the decimation until the RSS deviation is below t\n";
+    std::cerr << "  --project <f>   Project the points of a csv file (px,py) on the fitted curve\n";
+    std::cerr << "  --summary <f>   Write the sufficient statistics up to the degree to a summary file\n";
+    std::cerr << "  --from-summary  The input file is a summary: fit from its statistics\n";
+    std::cerr << "  --watch         Refit the csv file every time rows are appended to it\n";
+    std::cerr << "  --float         Store x and y as scaled floats, power sums in double\n";
+    std::cerr << "  --compensated   Same as --float, with double-double power sums\n";
+    std::cerr << "  --surface <d>   Fit V_target = f(x, y) with a total degree d (or dx x dy tensor product)\n";
+    std::cerr << "  --odr           Orthogonal distance fit, with errors on both x and y\n";
+    std::cerr << "  --xyratio <r>   Ratio of the error variances of y and x for --odr (default 1)\n";
+    std::cerr << "  --sweep         Fit a grid of configurations in one data pass and compare them\n";
+    std::cerr << "  --degrees <l>   Degrees of the sweep: list (2,4,6) or range (1-8)\n";
+    std::cerr << "  --weights <l>   Weighting schemes of the sweep (0,1,2)\n";
+    std::cerr << "  --intercepts <l> Intercepts of the sweep: free or a fixed value (free,0)\n";
+    std::cerr << "  --alphas <l>    Alpha values of the sweep (0.05,0.01)\n";
+    std::cerr << "  --sigma <f>     Errors on y of the points, one per line, for the weights 1 and 2 of the sweep\n";
+    std::cerr << "  --profile <f>   Profile the phases and write a trace-event JSON file\n";
+    std::cerr << "  --perf          Add the cpu cycle and cache miss counters to the profile\n";
+
+}
+
+// The main program
+// The benchmark (src/PolyfitBench.cpp) includes this file with
+// POLYFIT_NO_MAIN defined.
+// **************************************************************
+#ifndef POLYFIT_NO_MAIN
+int main(int argc, char* argv[]) {
+
+    bool multiresponse = false;                      // Fit y, R_c and V_target together
+
+    if (argc < 2) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    // Fit server on a Unix domain socket
+    // **************************************************************
+    if (strcmp(argv[1], "--serve") == 0) {
+        if (argc < 3) {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        size_t nthreads = max(std::thread::hardware_concurrency(), 1u);
+        size_t capacity = 64;
+        size_t maxdatasets = 16;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                nthreads = max(strtoul(argv[++i], NULL, 10), 1ul);
+            }
+            else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc) {
+                capacity = strtoul(argv[++i], NULL, 10);
+            }
+            else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+                maxdatasets = strtoul(argv[++i], NULL, 10);
+            }
+            else {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+        return RunFitServer(argv[2], nthreads, capacity, maxdatasets);
+    }
+
+    // Merge of summary files
+    // **************************************************************
+    if (strcmp(argv[1], "--merge") == 0) {
+        if (argc < 4) {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        return MergeSummaryFiles(argv[2], argv + 3, argc - 3);
+    }
+
+    bool parametric = false;                         // Fit x(s) and y(s)
+    bool periodic = false;                           // Close the parametric curve
+    size_t k = 4;                                    // Polynomial order
+    size_t maxseg = 0;                               // Number of segments (automatic breakpoints)
+    std::vector<double> breaks;                      // Interior breakpoints (explicit)
+    int continuity = -1;                             // Continuity between segments (-1 = none)
+    bool roots = false;                              // Find the extrema and inflection points
+    bool findlevel = false;                          // Also find the crossings of level
+    double level = 0.;                               // Level of the crossings
+    double luttolerance = 0.;                        // Max error of the lookup table, 0 if none
+    bool ridge = false;                              // Ridge regularized fit
+    double lambda = -1.;                             // Ridge lambda (< 0: selected by GCV)
+    int dtype = -1;                                  // Decimation: 0 = stride, 1 = arc length, 2 = curvature, 3 = leverage
+    size_t target = 512;                             // Number of points kept by the decimation
+    double tolerance = 0.;                           // Bound on the RSS deviation of the decimated fit
+    std::string projectfile;                         // Points to project on the fitted curve
+    std::string summaryfile;                         // Sufficient statistics written to this file
+    bool fromsummary = false;                        // The input file is a summary
+    bool watch = false;                              // Refit when rows are appended
+    bool singleprec = false;                         // Store the input as scaled floats
+    bool compensated = false;                        // Double-double power sums of the floats
+    size_t surfacedx = 0;                            // Degree of the surface fit in x (0 if none)
+    size_t surfacedy = 0;                            // Degree in y of a tensor product surface
+    bool tensor = false;                             // Tensor product surface
+    bool odr = false;                                // Orthogonal distance regression
+    double xyratio = 1.;                             // Ratio of the error variances of y and x
+    bool sweep = false;                              // Sweep of the fit configurations
+    std::vector<size_t> sweepdegrees;                // Degrees of the sweep (empty = the degree)
+    std::vector<int> sweepwtypes;                    // Weighting schemes of the sweep
+    std::vector<std::string> sweepintercepts;        // Fixed intercepts of the sweep (empty string = free)
+    std::vector<double> sweepalphas;                 // Alpha values of the sweep
+    std::string sigmafile;                           // Errors on y of the sweep (empty = none)
+    std::string profilefile;                         // Trace-event file of the profile (empty = off)
+    bool perfcounters = false;                       // Read the hardware counters when profiling
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--multi") == 0) {
+            multiresponse = true;
+        }
+        else if (strcmp(argv[i], "--parametric") == 0) {
+            parametric = true;
+        }
+        else if (strcmp(argv[i], "--periodic") == 0) {
+            parametric = true;
+            periodic = true;
+        }
+        else if (strcmp(argv[i], "--degree") == 0 && i + 1 < argc) {
+            k = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--segments") == 0 && i + 1 < argc) {
+            maxseg = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--breaks") == 0 && i + 1 < argc) {
+            std::istringstream ss(argv[++i]);
+            std::string token;
+            while (std::getline(ss, token, ',')) {
+                breaks.push_back(std::stod(token));
+            }
+            std::sort(breaks.begin(), breaks.end());
+        }
+        else if (strcmp(argv[i], "--continuity") == 0 && i + 1 < argc) {
+            continuity = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--decimate") == 0 && i + 1 < argc) {
+            const char* methods[4] = { "stride", "arclength", "curvature", "leverage" };
+            i++;
+            for (int d = 0; d < 4; d++) {
+                if (strcmp(argv[i], methods[d]) == 0) dtype = d;
+            }
+            if (dtype < 0) {
+                std::cerr << "Unknown decimation: " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--target") == 0 && i + 1 < argc) {
+            target = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--project") == 0 && i + 1 < argc) {
+            projectfile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--summary") == 0 && i + 1 < argc) {
+            summaryfile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--from-summary") == 0) {
+            fromsummary = true;
+        }
+        else if (strcmp(argv[i], "--watch") == 0) {
+            watch = true;
+        }
+        else if (strcmp(argv[i], "--surface") == 0 && i + 1 < argc) {
+            const char* spec = argv[++i];
+            const char* times = strchr(spec, 'x');
+            surfacedx = strtoul(spec, NULL, 10);
+            tensor = times != NULL;
+            surfacedy = tensor ? strtoul(times + 1, NULL, 10) : 0;
+            if (surfacedx == 0 || (tensor && surfacedy == 0)) {
+                std::cerr << "Invalid surface degree: " << spec << "\n";
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--odr") == 0) {
+            odr = true;
+        }
+        else if (strcmp(argv[i], "--xyratio") == 0 && i + 1 < argc) {
+            odr = true;
+            xyratio = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sweep") == 0) {
+            sweep = true;
+        }
+        else if (strcmp(argv[i], "--degrees") == 0 && i + 1 < argc) {
+            sweep = true;
+            std::istringstream ss(argv[++i]);
+            std::string token;
+            while (std::getline(ss, token, ',')) {
+                size_t dash = token.find('-');
+                size_t first = strtoul(token.c_str(), NULL, 10);
+                size_t last = (dash != std::string::npos) ? strtoul(token.c_str() + dash + 1, NULL, 10) : first;
+                for (size_t d = first; d <= last; d++) sweepdegrees.push_back(d);
+            }
+        }
+        else if (strcmp(argv[i], "--weights") == 0 && i + 1 < argc) {
+            sweep = true;
+            std::istringstream ss(argv[++i]);
+            std::string token;
+            while (std::getline(ss, token, ',')) {
+                sweepwtypes.push_back(atoi(token.c_str()));
+            }
+        }
+        else if (strcmp(argv[i], "--intercepts") == 0 && i + 1 < argc) {
+            sweep = true;
+            std::istringstream ss(argv[++i]);
+            std::string token;
+            while (std::getline(ss, token, ',')) {
+                sweepintercepts.push_back(token == "free" ? std::string() : token);
+            }
+        }
+        else if (strcmp(argv[i], "--alphas") == 0 && i + 1 < argc) {
+            sweep = true;
+            std::istringstream ss(argv[++i]);
+            std::string token;
+            while (std::getline(ss, token, ',')) {
+                sweepalphas.push_back(std::stod(token));
+            }
+        }
+        else if (strcmp(argv[i], "--sigma") == 0 && i + 1 < argc) {
+            sigmafile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--float") == 0) {
+            singleprec = true;
+        }
+        else if (strcmp(argv[i], "--compensated") == 0) {
+            singleprec = true;
+            compensated = true;
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profilefile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--perf") == 0) {
+            perfcounters = true;
+        }
+        else if (strcmp(argv[i], "--roots") == 0) {
+            roots = true;
+        }
+        else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+            roots = true;
+            findlevel = true;
+            level = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--lut") == 0 && i + 1 < argc) {
+            luttolerance = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ridge") == 0) {
+            ridge = true;
+        }
+        else if (strcmp(argv[i], "--lambda") == 0 && i + 1 < argc) {
+            ridge = true;
+            lambda = atof(argv[++i]);
+        }
+        else {
+            std::cerr << "Unknown option: " << argv[i] << "\n";
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
 
     cout << "Polynomial fit!" << endl;
 
+    ProfileSession profile(profilefile, perfcounters);
+    ProfileScope total("total");
+
     // Input values
     // **************************************************************
-    size_t k = 4;                                    // Polynomial order
     bool fixedinter = false;                         // Fixed the intercept (coefficient A0)
     int wtype = 0;                                   // Weight: 0 = none (default), 1 = sigma, 2 = 1/sigma^2
     double fixedinterval = 0.;                       // The fixed intercept value (if applicable)
     double alphaval = 0.05;                          // Critical apha value
 
-    // Custom datapoints from csv file
+    // Fit from the sufficient statistics of a summary file
     // **************************************************************
-    std::ifstream input(argv[1]);
-    if (!input) {
-        perror("Error opening input file");
-        return 1;
+    if (fromsummary) {
+        ProfileScope fit("fit_summary");
+        SufficientStats stats;
+        if (!ReadSufficientStats(argv[1], stats)) {
+            cout << "Error reading summary " << argv[1] << endl;
+            return 1;
+        }
+        return FitSufficientStats(stats, k, fixedinter, fixedinterval, alphaval) ? 0 : 1;
     }
 
-    std::string line;
-    std::vector<double> x_values, y_values;
+    // Incremental fit of a growing csv file
+    // **************************************************************
+    if (watch) {
+        return WatchCSV(argv[1], k, fixedinter, fixedinterval, alphaval);
+    }
+
+    // Custom datapoints from csv file
+    // **************************************************************
+    std::vector<double> x_values, y_values, rc_values, v_values;
     double *x, *y;
 
     // double y[] = { 372.5895394992980000,
@@ -938,24 +5966,9 @@ int main(int argc, char* argv[]) {
 
     // Initialize values
     // **************************************************************
-    std::getline(input, line); // Skip the header
-
-    while (std::getline(input, line)) {
-        std::istringstream ss(line);
-        std::string token;
-        std::vector<double> values;
-        while (std::getline(ss, token, ',')) {
-            values.push_back(std::stod(token));
-        }
-        if (values.size() >= 4) {
-            double csv_x = values[0];
-            double csv_y = values[1];
-            double R_c = values[2];
-            double V_target = values[3];
-            x_values.push_back(csv_x);
-            y_values.push_back(csv_y);
-            // std::cout << csv_x << " " << csv_y << " " << R_c << " " << V_target << std::endl;
-        }
+    ProfileScope load("load_csv");
+    if (!ReadCSV(argv[1], x_values, y_values, rc_values, v_values)) {
+        return 1;
     }
 
     // Convert vectors to arrays
@@ -964,32 +5977,222 @@ int main(int argc, char* argv[]) {
     std::copy(x_values.begin(), x_values.end(), x);
     std::copy(y_values.begin(), y_values.end(), y);
     n = x_values.size();
+    load.Stop();
 
     //n = sizeof(x) / sizeof(double);
     nstar = n - 1;
     if (fixedinter) nstar = n;
 
     cout << "Number of points: " << n << endl;
-    cout << "Polynomial order: " << k << endl;
-    if (fixedinter) {
-        cout << "A0 is fixed!" << endl;
-    }
-    else {
-        cout << "A0 is adjustable!" << endl;
+
+    // The sweep reports its own degrees and intercepts
+    if (!sweep) {
+        cout << "Polynomial order: " << k << endl;
+        if (fixedinter) {
+            cout << "A0 is fixed!" << endl;
+        }
+        else {
+            cout << "A0 is adjustable!" << endl;
+        }
+
+        if (k > nstar) {
+            cout << "The polynomial order is too high. Max should be " << n << " for adjustable A0 ";
+            cout << "and " << n - 1 << " for fixed A0. ";
+            cout << "Program stopped" << endl;
+            return -1;
+        }
+
+        if (k == nstar) {
+            cout << "The degree of freedom is equal to the number of points. ";
+            cout << "The fit will be exact." << endl;
+        }
     }
 
-    if (k > nstar) {
-        cout << "The polynomial order is too high. Max should be " << n << " for adjustable A0 ";
-        cout << "and " << n - 1 << " for fixed A0. ";
+    // Diagonal of the weight matrix, used by the alternative fits
+    // **************************************************************
+    std::vector<double> w(n);
+    CalculateWeights(erry, w.data(), n, wtype);
+
+    if (std::find(w.begin(), w.end(), 0.) != w.end()) {
+        cout << "One or more points have 0 error. Review the errors on points or use no weighting. ";
         cout << "Program stopped" << endl;
         return -1;
     }
 
-    if (k == nstar) {
-        cout << "The degree of freedom is equal to the number of points. ";
-        cout << "The fit will be exact." << endl;
+    // Sweep of the fit configurations, the settings above by default
+    // **************************************************************
+    if (sweep) {
+        ProfileScope fit("fit_sweep");
+        if (sweepdegrees.empty()) sweepdegrees.push_back(k);
+        if (sweepwtypes.empty()) sweepwtypes.push_back(wtype);
+        if (sweepintercepts.empty()) {
+            std::ostringstream value;
+            value << std::setprecision(17) << fixedinterval;
+            sweepintercepts.push_back(fixedinter ? value.str() : std::string());
+        }
+        if (sweepalphas.empty()) sweepalphas.push_back(alphaval);
+        std::vector<double> sigma_values(erry, erry + sizeof(erry) / sizeof(double));
+        if (!sigmafile.empty()) {
+            sigma_values.clear();
+            if (!ReadSigma(sigmafile, sigma_values)) {
+                free(x);
+                free(y);
+                return 1;
+            }
+            if (sigma_values.size() != n) {
+                cout << "The sigma file has " << sigma_values.size() << " values for " << n << " points. ";
+                cout << "Program stopped" << endl;
+                free(x);
+                free(y);
+                return 1;
+            }
+        }
+        bool ok = FitSweep(x, y, n, sigma_values.data(), sigma_values.size(), sweepdegrees, sweepwtypes,
+            sweepintercepts, sweepalphas);
+        free(x);
+        free(y);
+        return ok ? 0 : 1;
+    }
+
+    // Summary of the sufficient statistics up to order k
+    // **************************************************************
+    if (!summaryfile.empty()) {
+        ProfileScope build("build_summary");
+        SufficientStats stats;
+        BuildSufficientStats(x, y, w.data(), n, k, stats);
+        if (!WriteSufficientStats(summaryfile, stats)) {
+            cout << "Error writing summary " << summaryfile << endl;
+            return 1;
+        }
+        cout << "Summary of order " << k << " written to " << summaryfile << endl;
+        free(x);
+        free(y);
+        return 0;
+    }
+
+    // Surface fit of V_target against the position
+    // **************************************************************
+    if (surfacedx > 0) {
+        ProfileScope fit("fit_surface");
+        FitSurface(x, y, v_values.data(), "V_target", n, surfacedx, surfacedy, tensor, alphaval, w.data());
+        free(x);
+        free(y);
+        return 0;
+    }
+
+    // Fit from the input stored as scaled floats
+    // **************************************************************
+    if (singleprec) {
+        ProfileScope fit("fit_float");
+        FloatColumns cols;
+        SufficientStats stats;
+        PackFloatColumns(x, y, n, cols);
+        free(x);
+        free(y);
+        std::vector<double>().swap(x_values);
+        std::vector<double>().swap(y_values);
+        BuildSufficientStatsFloat(cols, w.data(), k, compensated, stats);
+        return FitSufficientStats(stats, k, fixedinter, fixedinterval, alphaval) ? 0 : 1;
+    }
+
+    // Nearest point queries on the fitted curve
+    // **************************************************************
+    if (!projectfile.empty()) {
+        ProfileScope fit("project");
+        ProjectOnFit(x, y, n, k, parametric, periodic, w.data(), projectfile);
+        free(x);
+        free(y);
+        return 0;
+    }
+
+    // Fit of a decimated subset
+    // **************************************************************
+    if (dtype >= 0) {
+        ProfileScope fit("fit_decimated");
+        FitDecimated(x, y, w.data(), n, k, fixedinter, fixedinterval, dtype, target, tolerance);
+        free(x);
+        free(y);
+        return 0;
+    }
+
+    // Orthogonal distance fit
+    // **************************************************************
+    if (odr) {
+        ProfileScope fit("fit_odr");
+        FitODR(x, y, n, k, xyratio, alphaval, w.data());
+        free(x);
+        free(y);
+        return 0;
+    }
+
+    // Piecewise fit, against x or against the arc length
+    // **************************************************************
+    // The roots and lookup table use a single segment if no breakpoints are given
+    // **************************************************************
+    if (maxseg > 0 || !breaks.empty() || roots || luttolerance > 0.) {
+        ProfileScope fit("fit_segmented");
+        PiecewisePoly pp;
+        bool ok = true;
+        double* Y[2] = { x, y };
+        const char* names[2] = { "x(s)", "y(s)" };
+        if (parametric) {
+            double* sarc = new double[n];
+            CalculateArcLength(x, y, n, false, sarc);
+            ok = FitSegmentedCurve(sarc, Y, names, n, 2, k, breaks, max(maxseg, (size_t)1), continuity, w.data(), &pp);
+            delete[] sarc;
+        }
+        else {
+            Y[0] = y;
+            names[0] = "y";
+            ok = FitSegmentedCurve(x, Y, names, n, 1, k, breaks, max(maxseg, (size_t)1), continuity, w.data(), &pp);
+        }
+        fit.Stop();
+        if (roots && !pp.breaks.empty()) {
+            ProfileScope find("roots");
+            WriteCurveRoots(pp, names, level, findlevel);
+        }
+        if (luttolerance > 0. && !pp.breaks.empty()) {
+            ProfileScope compile("lookup_table");
+            WriteLookup(pp, luttolerance);
+        }
+        free(x);
+        free(y);
+        return ok ? 0 : 1;
+    }
+
+    // Fit the track as a parametric curve of its arc length
+    // **************************************************************
+    if (parametric) {
+        ProfileScope fit("fit_parametric");
+        FitParametricCurve(x, y, n, k, periodic, alphaval, w.data());
+        free(x);
+        free(y);
+        return 0;
+    }
+
+    // Ridge regularized fit
+    // **************************************************************
+    if (ridge) {
+        ProfileScope fit("fit_ridge");
+        FitRidge(x, y, n, k, fixedinter, fixedinterval, alphaval, lambda, w.data());
+        free(x);
+        free(y);
+        return 0;
     }
 
+    // Fit all the responses with a single factorization
+    // **************************************************************
+    if (multiresponse) {
+        double* Y[3] = { y, rc_values.data(), v_values.data() };
+        const char* names[3] = { "y", "R_c", "V_target" };
+        ProfileScope fit("fit_multi");
+        FitMultiResponse(x, Y, names, n, 3, k, fixedinter, fixedinterval, alphaval, w.data());
+        free(x);
+        free(y);
+        return 0;
+    }
+
+    ProfileScope weights("build_weights");
     XTWXInv = Make2DArray(k + 1, k + 1);
     Weights = Make2DArray(n, n);
 
@@ -1005,14 +6208,18 @@ int main(int argc, char* argv[]) {
         cout << "Program stopped" << endl;
         return -1;
     }
+    weights.Stop();
 
     // Calculate the coefficients of the fit
     // **************************************************************
+    ProfileScope fit("polyfit");
     PolyFit(x, y, n, k, fixedinter, fixedinterval, coefbeta, Weights, XTWXInv);
+    fit.Stop();
 
 
     // Calculate related values
     // **************************************************************
+    ProfileScope statistics("statistics");
     double RSS = CalculateRSS(x, y, coefbeta, Weights, n, k + 1);
     double TSS = CalculateTSS(y, Weights, fixedinter, n);
     double R2 = CalculateR2COD(x, y, coefbeta, Weights, fixedinter, n, k + 1);
@@ -1027,9 +6234,11 @@ int main(int argc, char* argv[]) {
     // Calculate the standard errors on the coefficients
     // **************************************************************
     CalculateSERRBeta(fixedinter, SE, k, serbeta, XTWXInv);
+    statistics.Stop();
 
     // Display polynomial
     // **************************************************************
+    ProfileScope display("display");
     DisplayPolynomial(k);
 
     // Display polynomial coefficients
@@ -1043,14 +6252,19 @@ int main(int argc, char* argv[]) {
     // Display ANOVA table
     // **************************************************************
     DisplayANOVA(nstar, k, TSS, RSS);
+    display.Stop();
 
     // Write the prediction and confidence intervals
     // **************************************************************
+    ProfileScope bands("ci_bands");
     WriteCIBands("CIBands2.dat", x, coefbeta, XTWXInv, tstudentval, SE, n, k);
+    bands.Stop();
 
     // Display the covariance and correlation matrix
     // **************************************************************
+    ProfileScope covariance("covariance");
     DisplayCovCorrMatrix(k, SE, fixedinter, XTWXInv);
+    covariance.Stop();
 
     Free2DArray(XTWXInv, k + 1);
     Free2DArray(Weights, n);
@@ -1066,7 +6280,8 @@ int main(int argc, char* argv[]) {
 
     std::cout << "\nDerivative of polynomial at x = " << x_random << " is: " << derivative << std::endl;
 
+    ProfileScope plot("gnuplot");
     plot_data_and_polynomial(x_values, y_values, coefbeta, k);
 
 }
-
+#endif // POLYFIT_NO_MAIN
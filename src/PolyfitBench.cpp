@@ -0,0 +1,397 @@
+
+// ********************************************************************
+// * Benchmark of PolyFit                                             *
+// *                                                                  *
+// * Times separately the csv loading, the fit, the statistics, the   *
+// * Student t value, the CI bands and the generation of the plotted  *
+// * curve, on synthetic data sets of n points fitted with degree k.  *
+// * The original cofactor PolyFit is used as the reference for the   *
+// * speed and the accuracy of the fit. The fits of the input stored  *
+// * as scaled floats are compared with the same scaled fit of the    *
+// * input stored in double.                                          *
+// *                                                                  *
+// * The results are written as JSON. With --baseline, the timings    *
+// * are compared with a previous run and regressions are reported.   *
+// ********************************************************************
+
+#define POLYFIT_NO_MAIN
+#define POLYFIT_NO_ALLOC_HOOKS
+#include "Polyfit.cpp"
+
+#include <chrono>
+#include <map>
+
+// Synthetic data set
+// scenario: 0 = clean, 1 = noisy, 2 = noisy with 1% outliers,
+//           3 = ill-conditioned (x offset by 1000), 4 = closed-loop track
+// **************************************************************
+void GenerateSynthetic(const size_t n, const int scenario, const unsigned seed,
+    std::vector<double>& x, std::vector<double>& y) {
+
+    std::mt19937_64 rng(seed);
+    std::normal_distribution<double> noise(0., 1.);
+    std::uniform_real_distribution<double> uniform(0., 1.);
+    const double coef[5] = { 2., -1.5, 0.8, 0.3, -0.05 };
+
+    x.resize(n);
+    y.resize(n);
+
+    for (size_t i = 0; i < n; i++) {
+        double t = (n > 1) ? (double)i / (n - 1) : 0.;
+
+        if (scenario == 4) {
+            // Lap of a wavy oval track, about 3 km long
+            double theta = 2. * M_PI * t;
+            double r = 1. + 0.15 * sin(3. * theta) + 0.05 * cos(7. * theta);
+            x[i] = 600. * r * cos(theta) + 0.2 * noise(rng);
+            y[i] = 250. * r * sin(theta) + 0.2 * noise(rng);
+            continue;
+        }
+
+        double u = -5. + 10. * t;
+        x[i] = (scenario == 3) ? 1000. + u : u;
+        double poly = 0.;
+        for (size_t j = 5; j-- > 0;) poly = poly * u + coef[j];
+        y[i] = poly;
+        if (scenario >= 1) y[i] += 2. * noise(rng);
+        if (scenario == 2 && uniform(rng) < 0.01) y[i] += 200. * (uniform(rng) - 0.5);
+    }
+
+}
+
+// Time body(), repeating it until mintime seconds have been spent
+// Returns the best time of a single run.
+// **************************************************************
+double TimeIt(const std::function<void()>& body, const double mintime, size_t* reps) {
+
+    double best = 1.e300;
+    double total = 0.;
+    size_t count = 0;
+
+    do {
+        auto t0 = std::chrono::steady_clock::now();
+        body();
+        auto t1 = std::chrono::steady_clock::now();
+        double dt = std::chrono::duration<double>(t1 - t0).count();
+        best = min(best, dt);
+        total += dt;
+        count++;
+    } while (total < mintime);
+
+    *reps = count;
+    return best;
+
+}
+
+// One benchmark result
+// **************************************************************
+struct BenchResult {
+    std::string phase;
+    size_t n;
+    size_t k;
+    double seconds;
+    size_t reps;
+    double error;                                    // Accuracy vs the reference (-1 if not available)
+};
+
+// Write the results as JSON, one result per line
+// **************************************************************
+void WriteBenchJSON(const std::string& filename, const std::vector<BenchResult>& results, const int scenario) {
+
+    ofstream output;
+    output.open(filename.c_str());
+    output << std::setprecision(9);
+    output << "{\"scenario\": " << scenario << ", \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        output << (i == 0 ? "" : ",") << endl;
+        output << "{\"phase\": \"" << r.phase << "\", \"n\": " << r.n << ", \"k\": " << r.k;
+        output << ", \"seconds\": " << r.seconds << ", \"reps\": " << r.reps << ", \"error\": " << r.error << "}";
+    }
+    output << endl << "]}" << endl;
+    output.close();
+
+}
+
+// Read the timings of a JSON file written by WriteBenchJSON
+// **************************************************************
+bool ReadBenchJSON(const std::string& filename, std::map<std::string, double>& seconds) {
+
+    std::ifstream input(filename.c_str());
+    if (!input) {
+        perror("Error opening baseline file");
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(input, line)) {
+        char phase[64];
+        size_t n, k;
+        double sec;
+        if (sscanf(line.c_str(), "{\"phase\": \"%63[^\"]\", \"n\": %zu, \"k\": %zu, \"seconds\": %lf",
+            phase, &n, &k, &sec) == 4) {
+            seconds[std::string(phase) + "/" + std::to_string(n) + "/" + std::to_string(k)] = sec;
+        }
+    }
+
+    return true;
+
+}
+
+// Display the usage of the benchmark
+// **************************************************************
+void PrintBenchUsage(const char* program) {
+
+    std::cerr << "Usage: " << program << " [options]\n";
+    std::cerr << "Options:\n";
+    std::cerr << "  --nmin <n>        Smallest number of points (default 100)\n";
+    std::cerr << "  --nmax <n>        Largest number of points (default 100000000)\n";
+    std::cerr << "  --kmin <k>        Smallest degree (default 1)\n";
+    std::cerr << "  --kmax <k>        Largest degree (default 20)\n";
+    std::cerr << "  --scenario <s>    0 clean, 1 noisy, 2 outliers, 3 ill-conditioned, 4 track (default 1)\n";
+    std::cerr << "  --refmax <n>      Largest n for the cofactor reference fit (default 1000)\n";
+    std::cerr << "  --csvmax <n>      Largest n for the csv loading (default 10000000)\n";
+    std::cerr << "  --mintime <s>     Minimum time spent on each measurement (default 0.05)\n";
+    std::cerr << "  --out <file>      JSON output (default bench.json)\n";
+    std::cerr << "  --baseline <file> Compare with a previous JSON output\n";
+    std::cerr << "  --threshold <r>   Slowdown ratio reported as a regression (default 1.10)\n";
+
+}
+
+// The benchmark program
+// **************************************************************
+int main(int argc, char* argv[]) {
+
+    size_t nmin = 100;
+    size_t nmax = 100000000;
+    size_t kmin = 1;
+    size_t kmax = 20;
+    int scenario = 1;
+    size_t refmax = 1000;
+    size_t csvmax = 10000000;
+    double mintime = 0.05;
+    double threshold = 1.10;
+    std::string outfile = "bench.json";
+    std::string baseline;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            PrintBenchUsage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--nmin") == 0) nmin = (size_t)atof(argv[++i]);
+        else if (strcmp(argv[i], "--nmax") == 0) nmax = (size_t)atof(argv[++i]);
+        else if (strcmp(argv[i], "--kmin") == 0) kmin = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--kmax") == 0) kmax = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--scenario") == 0) scenario = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--refmax") == 0) refmax = (size_t)atof(argv[++i]);
+        else if (strcmp(argv[i], "--csvmax") == 0) csvmax = (size_t)atof(argv[++i]);
+        else if (strcmp(argv[i], "--mintime") == 0) mintime = atof(argv[++i]);
+        else if (strcmp(argv[i], "--out") == 0) outfile = argv[++i];
+        else if (strcmp(argv[i], "--baseline") == 0) baseline = argv[++i];
+        else if (strcmp(argv[i], "--threshold") == 0) threshold = atof(argv[++i]);
+        else {
+            PrintBenchUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    std::vector<double> x, y, w, rc, v;
+    std::ostringstream sink;                         // Swallows the output of the cofactor PolyFit
+
+    cout << std::setprecision(4);
+    cout << "Phase\tn\tk\tSeconds\tError" << endl;
+
+    auto record = [&](const std::string& phase, size_t n, size_t k, double sec, size_t reps, double error) {
+        BenchResult r = { phase, n, k, sec, reps, error };
+        results.push_back(r);
+        cout << phase << "\t" << n << "\t" << k << "\t" << sec << "\t" << error << endl;
+    };
+
+    for (size_t n = nmin; n <= nmax; n *= 10) {
+
+        GenerateSynthetic(n, scenario, 42, x, y);
+        w.assign(n, 1.);
+        size_t reps;
+        double sec;
+
+        // Csv loading
+        // **************************************************************
+        if (n <= csvmax) {
+            std::string csvfile = "bench_data.csv";
+            ofstream csv(csvfile.c_str());
+            csv << std::setprecision(10) << "x,y,R_c,V_target\n";
+            for (size_t i = 0; i < n; i++) csv << x[i] << "," << y[i] << ",0,0\n";
+            csv.close();
+            sec = TimeIt([&]() {
+                std::vector<double> xs, ys;
+                rc.clear();
+                v.clear();
+                ReadCSV(csvfile, xs, ys, rc, v);
+            }, mintime, &reps);
+            record("csv_load", n, 0, sec, reps, -1.);
+            remove(csvfile.c_str());
+        }
+
+        for (size_t k = kmin; k <= kmax && k + 1 < n; k++) {
+
+            double* Y[1] = { y.data() };
+            double* beta[1] = { new double[k + 1] };
+            double* ref = new double[k + 1];
+            double* serbeta = new double[k + 1];
+            double** XTWXInv = Make2DArray(k + 1, k + 1);
+
+            // Reference: cofactor PolyFit with the full weights matrix
+            // **************************************************************
+            double RSSref = -1.;
+            if (n <= refmax) {
+                double** Weights = Make2DArray(n, n);
+                CalculateWeights(NULL, Weights, n, 0);
+                std::streambuf* saved = cout.rdbuf(sink.rdbuf());
+                sec = TimeIt([&]() {
+                    sink.str("");
+                    PolyFit(x.data(), y.data(), n, k, false, 0., ref, Weights, XTWXInv);
+                }, mintime, &reps);
+                cout.rdbuf(saved);
+                RSSref = CalculateRSS(x.data(), y.data(), ref, w.data(), n, k + 1);
+                record("polyfit_cofactor", n, k, sec, reps, 0.);
+                Free2DArray(Weights, n);
+            }
+
+            // Power sums and Cholesky factorization
+            // **************************************************************
+            sec = TimeIt([&]() {
+                PolyFit(x.data(), Y, n, 1, k, false, 0., beta, w.data(), XTWXInv);
+            }, mintime, &reps);
+            double RSS = CalculateRSS(x.data(), y.data(), beta[0], w.data(), n, k + 1);
+            record("polyfit", n, k, sec, reps, (RSSref > 0.) ? RSS / RSSref - 1. : -1.);
+
+            // Scaled power sums of the input stored in double (reference)
+            // and in float, with double and double-double accumulation. The
+            // error is the largest deviation of the fitted values from the
+            // reference over the data, relative to the largest fitted value
+            // (first order in the coefficient error, unlike the RSS). The
+            // fits are evaluated in the scaled x.
+            // **************************************************************
+            auto scaledFit = [&](const SufficientStats& stats, std::vector<double>& fit) {
+                double** XTWY = Make2DArray(1, k + 1);
+                double** inverse = Make2DArray(k + 1, k + 1);
+                double* b[1] = { new double[k + 1] };
+                std::copy(stats.Sy.begin(), stats.Sy.begin() + k + 1, XTWY[0]);
+                SolvePowerSums(stats.S.data(), XTWY, 1, k, false, 0., b, inverse);
+                fit.resize(n);
+                for (size_t i = 0; i < n; i++) fit[i] = stats.ycenter + HornerPoly((x[i] - stats.center) / stats.scale, b[0], k);
+                Free2DArray(XTWY, 1);
+                Free2DArray(inverse, k + 1);
+                delete[] b[0];
+            };
+
+            SufficientStats stats;
+            sec = TimeIt([&]() {
+                FitResult result;
+                BuildSufficientStats(x.data(), y.data(), w.data(), n, k, stats);
+                SolveSufficientStats(stats, k, false, 0., 0.05, result);
+            }, mintime, &reps);
+            std::vector<double> fitscaled, fitfloat;
+            scaledFit(stats, fitscaled);
+            double fitmax = 0.;
+            for (size_t i = 0; i < n; i++) fitmax = max(fitmax, fabs(fitscaled[i]));
+            record("polyfit_scaled", n, k, sec, reps, -1.);
+
+            FloatColumns cols;
+            sec = TimeIt([&]() {
+                PackFloatColumns(x.data(), y.data(), n, cols);
+            }, mintime, &reps);
+            record("float_pack", n, k, sec, reps, -1.);
+
+            for (int dd = 0; dd < 2; dd++) {
+                sec = TimeIt([&]() {
+                    FitResult result;
+                    BuildSufficientStatsFloat(cols, NULL, k, dd == 1, stats);
+                    SolveSufficientStats(stats, k, false, 0., 0.05, result);
+                }, mintime, &reps);
+                scaledFit(stats, fitfloat);
+                double deviation = 0.;
+                for (size_t i = 0; i < n; i++) deviation = max(deviation, fabs(fitfloat[i] - fitscaled[i]));
+                record(dd ? "polyfit_float_dd" : "polyfit_float", n, k, sec, reps, deviation / fitmax);
+            }
+
+            // Statistics
+            // **************************************************************
+            double SE = 0.;
+            double R2 = 0.;
+            double R2Adj = 0.;
+            sec = TimeIt([&]() {
+                double rss = CalculateRSS(x.data(), y.data(), beta[0], w.data(), n, k + 1);
+                double tss = CalculateTSS(y.data(), w.data(), false, n);
+                R2 = 1. - rss / tss;
+                R2Adj = 1. - (n - 1.) / (n - k - 1.) * rss / tss;
+                SE = sqrt(rss / (n - k - 1.));
+                CalculateSERRBeta(false, SE, k, serbeta, XTWXInv);
+            }, mintime, &reps);
+            record("statistics", n, k, sec, reps, -1.);
+
+            // Student t value
+            // **************************************************************
+            double tstudentval = 0.;
+            sec = TimeIt([&]() {
+                tstudentval = fabs(CalculateTValueStudent(n - 1. - k, 0.975));
+            }, mintime, &reps);
+            record("tstudent", n, k, sec, reps, -1.);
+
+            // CI bands
+            // **************************************************************
+            sec = TimeIt([&]() {
+                WriteCIBands("bench_CIBands.dat", x.data(), beta[0], XTWXInv, tstudentval, SE, n, k);
+            }, mintime, &reps);
+            remove("bench_CIBands.dat");
+            record("ci_bands", n, k, sec, reps, -1.);
+
+            // Data of the plotted curve
+            // **************************************************************
+            std::vector<double> xc, yc;
+            sec = TimeIt([&]() {
+                generate_polynomial_curve(x, beta[0], k, xc, yc);
+            }, mintime, &reps);
+            record("plot_data", n, k, sec, reps, -1.);
+
+            delete[] beta[0];
+            delete[] ref;
+            delete[] serbeta;
+            Free2DArray(XTWXInv, k + 1);
+        }
+
+    }
+
+    WriteBenchJSON(outfile, results, scenario);
+    cout << endl << "Results written to " << outfile << endl;
+
+    // Comparison with the baseline
+    // **************************************************************
+    if (!baseline.empty()) {
+        std::map<std::string, double> base;
+        if (!ReadBenchJSON(baseline, base)) return 1;
+
+        size_t regressions = 0;
+        cout << endl << "Comparison with " << baseline << endl;
+        cout << "Phase\tn\tk\tBaseline\tCurrent\tRatio" << endl;
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchResult& r = results[i];
+            std::string key = r.phase + "/" + std::to_string(r.n) + "/" + std::to_string(r.k);
+            if (base.count(key) == 0) continue;
+            double ratio = r.seconds / base[key];
+            cout << r.phase << "\t" << r.n << "\t" << r.k << "\t" << base[key] << "\t" << r.seconds << "\t" << ratio;
+            if (ratio > threshold) {
+                cout << "\tREGRESSION";
+                regressions++;
+            }
+            cout << endl;
+        }
+        cout << endl << regressions << " regression(s)" << endl;
+        if (regressions > 0) return 2;
+    }
+
+    return 0;
+
+}